@@ -0,0 +1,193 @@
+#!/bin/sh
+# Run every scenario of the scenario file with every method, several times each,
+# and report the median throughput with its confidence interval as JSON.
+# If a baseline report exists, also flag the throughput drops over the threshold
+# and exit with status 1 if there are any, so that upgrades can be gated on it.
+# A drop only counts if the whole confidence interval lies below both the baseline
+# median minus the threshold and the baseline interval, so that noise does not.
+# Methods that deadlocked, now or in the baseline, are left out of the gate: their
+# throughput only tells how long it took.
+#
+# Settings (from the environment, see also the bench targets of the Makefile):
+#   LOCKARENA        binary to run (default ./lockarena, better built with -DNDEBUG)
+#   BENCH_SCENARIOS  scenario file (default bench/scenarios)
+#   BENCH_REPS       repetitions of each scenario (default 5)
+#   BENCH_DURATION   measurement duration of each run, in seconds (default 1)
+#   BENCH_SEED       seed of the first repetition, the next ones use the following
+#                    seeds so that all versions run the same jobs (default 1)
+#   BENCH_WATCHDOG   deadlock watchdog, in milliseconds (default 1000)
+#   BENCH_THRESHOLD  throughput drop flagged as a regression, in percent (default 5)
+#   BENCH_BASELINE   report to compare with, if any (default bench/baseline.json)
+#   BENCH_REPORT     where to write the report (default bench/report.json)
+
+LOCKARENA=${LOCKARENA:-./lockarena}
+BENCH_SCENARIOS=${BENCH_SCENARIOS:-bench/scenarios}
+BENCH_REPS=${BENCH_REPS:-5}
+BENCH_DURATION=${BENCH_DURATION:-1}
+BENCH_SEED=${BENCH_SEED:-1}
+BENCH_WATCHDOG=${BENCH_WATCHDOG:-1000}
+BENCH_THRESHOLD=${BENCH_THRESHOLD:-5}
+BENCH_BASELINE=${BENCH_BASELINE-bench/baseline.json}
+BENCH_REPORT=${BENCH_REPORT:-bench/report.json}
+
+if ! test -x "$LOCKARENA"; then
+	echo "Cannot run $LOCKARENA" >&2
+	exit 1
+fi
+if ! test -r "$BENCH_SCENARIOS"; then
+	echo "Cannot read $BENCH_SCENARIOS" >&2
+	exit 1
+fi
+
+tmp=$(mktemp -d) || exit 1
+trap 'rm -rf "$tmp"' EXIT
+records=$tmp/records
+run=$tmp/run.json	# lockarena writes JSON records to files named so
+log=$tmp/log
+
+#
+# Runs
+#
+
+grep -v -e '^#' -e '^[[:space:]]*$' "$BENCH_SCENARIOS" | while read -r name opts; do
+	rep=1
+	while test $rep -le "$BENCH_REPS"; do
+		echo "$name: run $rep/$BENCH_REPS" >&2
+		seed=$((BENCH_SEED + rep - 1))
+		# shellcheck disable=SC2086 # opts are several options
+		$LOCKARENA -m all $opts -d "$BENCH_DURATION" -w "$BENCH_WATCHDOG" -S $seed -o "$run" \
+			< /dev/null > "$log" 2>&1
+		status=$?
+		# 2 only tells that some method deadlocked, which is recorded per method
+		if test $status -ne 0 && test $status -ne 2; then
+			tail -n 5 "$log" >&2
+			echo "$name: $LOCKARENA $opts failed with status $status" >&2
+			exit 1
+		fi
+		sed -e "s/^/$name	/" "$run" >> "$records"
+		rep=$((rep + 1))
+	done
+done || exit 1
+
+#
+# Report
+#
+
+test -n "$BENCH_BASELINE" && ! test -r "$BENCH_BASELINE" && BENCH_BASELINE=
+
+awk -F '\t' -v reps="$BENCH_REPS" -v duration="$BENCH_DURATION" -v seed="$BENCH_SEED" \
+	-v threshold="$BENCH_THRESHOLD" -v baseline="$BENCH_BASELINE" \
+	-v report="$BENCH_REPORT" '
+function str(rec, name)
+{
+	if (! match(rec, "\"" name "\":\"[^\"]*\"")) return ""
+	return substr(rec, RSTART + length(name) + 4, RLENGTH - length(name) - 5)
+}
+
+function num(rec, name)
+{
+	if (! match(rec, "\"" name "\":[^,}]*")) return ""
+	return substr(rec, RSTART + length(name) + 3, RLENGTH - length(name) - 3)
+}
+
+function sort(v, n,    i, j, x)
+{
+	for (i = 2; i <= n; i++) {
+		x = v[i]
+		for (j = i - 1; j > 0 && v[j] > x; j--) v[j + 1] = v[j]
+		v[j + 1] = x
+	}
+}
+
+function median(v, n)
+{
+	return n % 2 ? v[(n + 1) / 2] : (v[n / 2] + v[n / 2 + 1]) / 2
+}
+
+# Distribution free interval of the median: [v[lo], v[n+1-lo]] for the largest
+# lo such that P(B < lo) <= 2.5% where B ~ Binomial(n, 1/2), or the whole range
+# if there are too few runs for 95%, ci_level telling the actual confidence.
+function median_ci(v, n,    p, below, lo)
+{
+	p = 0.5 ^ n	# P(B = 0)
+	below = p	# P(B < lo)
+	lo = 1
+	while (lo + 1 <= (n + 1) / 2) {
+		p = p * (n - lo + 1) / lo	# P(B = lo)
+		if (below + p > 0.025) break
+		below += p
+		lo++
+	}
+	ci_low = v[lo]
+	ci_high = v[n + 1 - lo]
+	ci_level = 1 - 2 * below
+}
+
+BEGIN {
+	while (baseline != "" && (getline line < baseline) > 0) {
+		if (line !~ /"scenario"/) continue
+		k = str(line, "scenario") SUBSEP str(line, "method")
+		match(line, "\"jobs_per_sec\":[{]\"median\":[^,]*")
+		base[k] = substr(line, RSTART + 25, RLENGTH - 25) + 0
+		base_low[k] = num(line, "ci_low") + 0
+		base_deadlocks[k] = num(line, "deadlocks") + 0
+	}
+}
+
+{
+	k = $1 SUBSEP str($2, "method")
+	if (! (k in runs)) {
+		keys[nb_keys++] = k
+		primitive[k] = str($2, "primitive")
+	}
+	n = ++runs[k]
+	jps[k, n] = num($2, "jobs_per_sec")
+	err[k, n] = num($2, "error_rate")
+	if (num($2, "deadlock_after") + 0 >= 0) deadlocks[k]++
+}
+
+END {
+	printf "{\"reps\":%d,\"duration\":%s,\"seed\":%d,\"threshold\":%s,\"baseline\":%s,\"results\":[\n",
+		reps, duration, seed, threshold, baseline == "" ? "null" : "\"" baseline "\"" > report
+	printf "%-18s %-14s %12s %26s %12s %8s\n", "scenario", "method", "jobs/s", "ci", "baseline", "change"
+	for (i = 0; i < nb_keys; i++) {
+		k = keys[i]
+		split(k, sm, SUBSEP)
+		n = runs[k]
+		for (r = 1; r <= n; r++) v[r] = jps[k, r] + 0
+		sort(v, n)
+		m = median(v, n)
+		median_ci(v, n)
+		for (r = 1; r <= n; r++) e[r] = err[k, r] + 0
+		sort(e, n)
+		change = "null"
+		flag = "false"
+		gated = (k in base) && base[k] > 0 && ! deadlocks[k] && ! base_deadlocks[k] ? "true" : "false"
+		if (k in base && base[k] > 0) {
+			change = sprintf("%.4f", m / base[k] - 1)
+			if (gated == "true" && ci_high < base[k] * (1 - threshold / 100) && ci_high < base_low[k]) {
+				flag = "true"
+				nb_regressions++
+			}
+		}
+		printf "{\"scenario\":\"%s\",\"method\":\"%s\",\"primitive\":\"%s\",\"runs\":%d,\"deadlocks\":%d,", \
+			sm[1], sm[2], primitive[k], n, deadlocks[k] > report
+		printf "\"jobs_per_sec\":{\"median\":%.3f,\"ci_low\":%.3f,\"ci_high\":%.3f,\"ci_level\":%.4f},", \
+			m, ci_low, ci_high, ci_level > report
+		printf "\"error_rate\":{\"median\":%.6f},\"baseline\":%s,\"change\":%s,\"gated\":%s,\"regression\":%s}%s\n", \
+			median(e, n), (k in base) ? sprintf("%.3f", base[k]) : "null", change, gated, flag, \
+			(i < nb_keys - 1 ? "," : "") > report
+		printf "%-18s %-14s %12.0f %12.0f..%-12.0f %12s %7s%s%s\n", sm[1], sm[2], m, ci_low, ci_high, \
+			(k in base) ? sprintf("%.0f", base[k]) : "-", change == "null" ? "-" : sprintf("%+.1f%%", change * 100), \
+			flag == "true" ? " REGRESSION" : "", deadlocks[k] ? " (" deadlocks[k] " deadlocked, not gated)" : \
+			(k in base) && base_deadlocks[k] ? " (deadlocked in the baseline, not gated)" : ""
+	}
+	printf "]}\n" > report
+	close(report)
+	if (baseline == "") {
+		printf "No baseline to compare with\n"
+	} else if (nb_regressions) {
+		printf "%d throughput drops over %s%% compared to %s\n", nb_regressions, threshold, baseline
+		exit 1
+	}
+}' "$records"
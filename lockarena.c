@@ -11,354 +11,4698 @@
 #include <pthread.h>
 #include <signal.h>
 #include <time.h>
+#include <sched.h>
+#include <errno.h>
+#include <math.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <linux/mempolicy.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <ucontext.h>
 
 #define NB_ELEMS(x) (sizeof(x) / sizeof(*(x)))
 
-static unsigned method = 1, nb_threads = 100, nb_locks = 100;
-static unsigned nb_claimed = 3, max_sleep_usec = 1000, duration = 1;
+static unsigned method = 1, primitive = 0, nb_threads = 100, nb_locks = 100;
+static unsigned nb_claimed = 3, job_size = 1000;	// job_size unit depends on the job model
+static double duration = 1;	// of the measurement, in seconds
 static unsigned long long timeout_nsec = 1000000ULL;
+static uint64_t seed;
 static pthread_t *pthread_ids;
-static pthread_mutex_t *locks;
-static uint64_t nb_errs, nb_trys;
+static char *locks;	// nb_locks locks of the current primitive, see below
+static bool verbose = false;
+
+#define CACHE_LINE 64
+#define COUNTER_INC(c) __atomic_store_n(&(c), (c)+1, __ATOMIC_RELAXED)
+#define COUNTER_GET(c) __atomic_load_n(&(c), __ATOMIC_RELAXED)
+
+/*
+ * Log-linear latency histograms (as HdrHistogram): values below HIST_SUB are exact, then each
+ * power of two is split into HIST_SUB buckets, so that the relative error is below 1/HIST_SUB.
+ */
+
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1U << HIST_SUB_BITS)
+#define HIST_MAX_BITS 36	// about 69s in nanoseconds; above that values are clamped
+#define HIST_NB_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB)
+
+struct histo {
+	uint32_t count[HIST_NB_BUCKETS];
+	uint64_t max;
+};
+
+enum histo_kind { HIST_ACQUIRE, HIST_HOLD, HIST_REJECT, HIST_FIRST_FAIL, NB_HISTOS };
+static char const *histo_names[NB_HISTOS] = { "acquire", "hold", "reject", "first failure" };
+static char const *histo_keys[NB_HISTOS] = { "acquire", "hold", "reject", "first_failure" };	// for records
+
+static unsigned histo_bucket(uint64_t v)
+{
+	if (v < HIST_SUB) return v;
+	unsigned msb = 63 - __builtin_clzll(v);
+	if (msb >= HIST_MAX_BITS) {
+		msb = HIST_MAX_BITS - 1;
+		v = UINT64_MAX;
+	}
+	unsigned const shift = msb - HIST_SUB_BITS;
+	return (shift + 1) * HIST_SUB + ((v >> shift) & (HIST_SUB - 1));
+}
+
+// highest value that falls in that bucket
+static uint64_t histo_value(unsigned b)
+{
+	if (b < HIST_SUB) return b;
+	unsigned const shift = b / HIST_SUB - 1;
+	return ((uint64_t)(HIST_SUB + b % HIST_SUB + 1) << shift) - 1;
+}
+
+// Only ever called by the thread owning the histogram
+static void histo_add(struct histo *h, uint64_t v)
+{
+	COUNTER_INC(h->count[histo_bucket(v)]);
+	if (v > h->max) __atomic_store_n(&h->max, v, __ATOMIC_RELAXED);
+}
+
+struct histo_sum {
+	uint64_t count[HIST_NB_BUCKETS];
+	uint64_t total, max;
+};
+
+static void histo_merge(struct histo_sum *sum, struct histo const *h)
+{
+	for (unsigned b = 0; b < HIST_NB_BUCKETS; b++) {
+		uint64_t const c = COUNTER_GET(h->count[b]);
+		sum->count[b] += c;
+		sum->total += c;
+	}
+	uint64_t const max = COUNTER_GET(h->max);
+	if (max > sum->max) sum->max = max;
+}
+
+static uint64_t histo_percentile(struct histo_sum const *sum, double p)
+{
+	if (sum->total == 0) return 0;
+	uint64_t const rank = p * (sum->total - 1) + 1;
+	uint64_t seen = 0;
+	for (unsigned b = 0; b < HIST_NB_BUCKETS; b++) {
+		seen += sum->count[b];
+		if (seen >= rank) {
+			uint64_t const v = histo_value(b);
+			return v < sum->max ? v : sum->max;
+		}
+	}
+	return sum->max;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void timespec_from_ns(struct timespec *ts, uint64_t ns)
+{
+	ts->tv_sec = ns / 1000000000ULL;
+	ts->tv_nsec = ns % 1000000000ULL;
+}
+
+// Per thread state of the workers. Counters are only written by their thread.
+struct trace_event;
+#define NB_PERF_COUNTERS 5
+
+static struct thread_ctx {
+	uint64_t nb_trys, nb_errs;
+	uint64_t nb_retries, nb_given_up;	// when retrying failed jobs
+	uint64_t nb_excl_shared;	// shared claims taken exclusively, for want of a shared mode
+	// For the watchdog:
+	uint64_t last_progress;	// date of the last lock taken, rejected or released
+	unsigned waiting;	// lock being waited for, or UINT_MAX
+	bool timed_wait;	// and the wait is bounded, so it ends by itself
+	unsigned nb_held;	// number of valid entries in claimed
+	unsigned *claimed;	// locks taken by the current job
+	bool done;
+	unsigned gen;	// run_gen when the run started
+	uint64_t rand_state[4];
+	struct histo histos[NB_HISTOS];
+	struct trace_event *trace;	// ring of trace_mask+1 events, or NULL
+	uint64_t trace_head;	// number of events recorded so far
+	unsigned replay_next;	// next job to replay
+	int perf_fds[NB_PERF_COUNTERS];	// -1 if not opened, the first opened one leads the group
+	int perf_leader;
+	uint64_t perf_calls;	// number of measured calls
+	int64_t perf_counts[NB_PERF_COUNTERS];	// only valid once the thread is done, negative if never counted
+	// Read and written by the other threads (wait-die, wound-wait), so on a line of their own
+	uint64_t job_ts __attribute__((aligned(CACHE_LINE)));	// start of the current job, kept across restarts
+	bool wounded;	// set by other threads (wound-wait) to ask the current job to abort
+} __attribute__((aligned(CACHE_LINE))) *thread_ctxs;
+
+/*
+ * Placement: pin the workers to CPUs, compactly (filling a node before the next) or scattered
+ * across nodes, and optionally place their private rows of the methods state on their node,
+ * either by having each worker first-touch its own rows or by binding them. Rows are placed
+ * at page granularity so neighbouring threads may share a page if they are small.
+ */
+
+enum placement { PLACE_NONE, PLACE_COMPACT, PLACE_SCATTER };
+static char const *placement_names[] = { "none", "compact", "scatter" };
+static enum placement placement = PLACE_NONE;
+enum mem_policy { MEM_DEFAULT, MEM_TOUCH, MEM_BIND };
+static char const *mem_policy_names[] = { "default", "touch", "bind" };
+static enum mem_policy mem_policy = MEM_DEFAULT;
+
+#define MAX_NODES 1024
+static unsigned nb_cpus, nb_nodes;
+static unsigned place_cpus[CPU_SETSIZE];	// workers use them in turn
+static unsigned cpu_nodes[CPU_SETSIZE];
+
+static struct placed_rows {
+	char *base;
+	size_t row_size, size;
+} placed_rows[4];	// allocated by the current method
+static unsigned nb_placed_rows;
+
+// Parse a sysfs cpu list such as "0-3,8-11" into set, returns -1 on error
+static int parse_cpulist(char const *str, cpu_set_t *set)
+{
+	CPU_ZERO(set);
+	while (*str && *str != '\n') {
+		char *end;
+		unsigned long const first = strtoul(str, &end, 10);
+		unsigned long last = first;
+		if (end == str) return -1;
+		if (*end == '-') {
+			str = end+1;
+			last = strtoul(str, &end, 10);
+			if (end == str) return -1;
+		}
+		for (unsigned long c = first; c <= last && c < CPU_SETSIZE; c++) CPU_SET(c, set);
+		str = *end == ',' ? end+1 : end;
+	}
+	return 0;
+}
+
+static int topology_init(void)
+{
+	cpu_set_t allowed;
+	if (0 != sched_getaffinity(0, sizeof(allowed), &allowed)) {
+		fprintf(stderr, "Cannot get CPU affinity: %s\n", strerror(errno));
+		return -1;
+	}
+
+	// Nodes of each CPU, if the kernel knows about NUMA (otherwise it's all node 0)
+	nb_nodes = 1;
+	memset(cpu_nodes, 0, sizeof(cpu_nodes));
+	for (unsigned n = 0; n < MAX_NODES; n++) {
+		char path[64], list[4096];
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%u/cpulist", n);
+		FILE *f = fopen(path, "r");
+		if (! f) continue;	// node numbers may have holes
+		cpu_set_t set;
+		bool const ok = fgets(list, sizeof(list), f) && 0 == parse_cpulist(list, &set);
+		fclose(f);
+		if (! ok) continue;
+		for (unsigned c = 0; c < CPU_SETSIZE; c++) {
+			if (CPU_ISSET(c, &set)) cpu_nodes[c] = n;
+		}
+		if (n >= nb_nodes) nb_nodes = n+1;
+	}
+
+	// Compact is node by node, scatter takes the next CPU of each node in turn
+	nb_cpus = 0;
+	for (unsigned rank = 0; nb_cpus < (unsigned)CPU_COUNT(&allowed); rank++) {
+		for (unsigned n = 0; n < nb_nodes; n++) {
+			unsigned r = 0;
+			for (unsigned c = 0; c < CPU_SETSIZE; c++) {
+				if (! CPU_ISSET(c, &allowed) || cpu_nodes[c] != n) continue;
+				if (placement == PLACE_COMPACT || r++ == rank) place_cpus[nb_cpus++] = c;
+				if (placement == PLACE_SCATTER && r > rank) break;
+			}
+		}
+		if (placement == PLACE_COMPACT) break;
+	}
+
+	printf("Topology: %u CPUs on %u nodes, %s placement, %s memory policy\n",
+		nb_cpus, nb_nodes, placement_names[placement], mem_policy_names[mem_policy]);
+	if (verbose) {
+		printf("CPUs in placement order:");
+		for (unsigned i = 0; i < nb_cpus; i++) printf(" %u(node %u)", place_cpus[i], cpu_nodes[place_cpus[i]]);
+		printf("\n");
+	}
+	return 0;
+}
+
+static unsigned thread_cpu(unsigned t)
+{
+	return place_cpus[t % nb_cpus];
+}
+
+static void place_thread_attr(pthread_attr_t *attr, unsigned t)
+{
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(thread_cpu(t), &set);
+	pthread_attr_setaffinity_np(attr, sizeof(set), &set);
+}
+
+static void rows_bind(struct placed_rows const *r)
+{
+	static bool warned = false;
+	size_t const page = sysconf(_SC_PAGESIZE);
+	uintptr_t bound = (uintptr_t)r->base;
+	for (unsigned t = 0; t < nb_threads; t++) {
+		uintptr_t const start = (uintptr_t)r->base + t * r->row_size;
+		uintptr_t const stop = (start + r->row_size + page - 1) & ~(page - 1);
+		uintptr_t const from = (start & ~(page - 1)) < bound ? bound : start & ~(page - 1);
+		if (from >= stop) continue;
+		unsigned long mask[MAX_NODES / (8 * sizeof(unsigned long))] = { 0 };
+		unsigned const n = cpu_nodes[thread_cpu(t)];
+		mask[n / (8 * sizeof(*mask))] |= 1UL << (n % (8 * sizeof(*mask)));
+		if (0 != syscall(SYS_mbind, (void *)from, stop - from, MPOL_BIND, mask, sizeof(mask) * 8 + 1, 0) && ! warned) {
+			fprintf(stderr, "Cannot bind memory: %s\n", strerror(errno));
+			warned = true;
+		}
+		bound = stop;
+	}
+}
+
+// Allocates nb_threads zeroed rows of row_size bytes, aligned on a cache line at least
+static void *rows_alloc(size_t row_size)
+{
+	size_t const size = nb_threads * row_size;
+	if (mem_policy == MEM_DEFAULT) {
+		void *p;
+		if (0 != posix_memalign(&p, CACHE_LINE, size)) return NULL;
+		memset(p, 0, size);
+		return p;
+	}
+
+	// Fresh pages, that are not touched yet
+	void *p = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED) return NULL;
+	assert(nb_placed_rows < NB_ELEMS(placed_rows));
+	struct placed_rows *r = placed_rows + nb_placed_rows++;
+	r->base = p;
+	r->row_size = row_size;
+	r->size = size;
+	if (mem_policy == MEM_BIND) rows_bind(r);
+	return p;
+}
+
+static void rows_free(void *p)
+{
+	if (mem_policy == MEM_DEFAULT) {
+		free(p);
+		return;
+	}
+	if (! p) return;
+	for (unsigned i = 0; i < nb_placed_rows; i++) {
+		if (placed_rows[i].base != p) continue;
+		munmap(p, placed_rows[i].size);
+		placed_rows[i] = placed_rows[--nb_placed_rows];
+		return;
+	}
+	assert(!"Unknown rows");
+}
+
+// Called by each worker before it starts
+static void rows_touch(unsigned t)
+{
+	if (mem_policy != MEM_TOUCH) return;
+	for (unsigned i = 0; i < nb_placed_rows; i++) {
+		memset(placed_rows[i].base + t * placed_rows[i].row_size, 0, placed_rows[i].row_size);
+	}
+}
+
+/*
+ * Tasks: with -n the logical threads run as tasks on a smaller pool of workers, each with its
+ * own FIFO run queue, idle workers stealing from the tail of the others. A task leaves its
+ * worker when it would block (on a lock, a backoff or a sleeping job) and after each job, and
+ * resumes on whichever worker picks it up next, so that methods cannot depend on the OS thread.
+ * Blocking lock attempts then become trylock loops, yielding in between.
+ */
+
+#define TASK_STACK_SIZE (256 * 1024)	// plus TASK_FRAME_SIZE per thread and claim, see tasks_init
+#define TASK_FRAME_SIZE 512
+#define TASK_IDLE_NSEC 20000ULL	// how long a worker sleeps when it has nothing to run
+
+static unsigned nb_workers;	// 0 to run each logical thread on its own OS thread
+static unsigned pool_size;	// workers of the current run
+static size_t task_stack_size;
+
+struct worker;
+static struct task {
+	ucontext_t uc;
+	char *stack;	// preceded by a guard page
+	struct worker *worker;	// currently running it
+	uint64_t wake;	// must not be resumed before that date
+	bool finished;
+} *tasks;
+
+static struct worker {
+	pthread_mutex_t lock;	// protects the queue
+	unsigned *queue;	// ring of nb_threads task indices
+	unsigned head, nb;
+	ucontext_t sched;	// where tasks yield to
+} __attribute__((aligned(CACHE_LINE))) *workers;
+
+static unsigned tasks_left;
+static bool workers_stop;	// leave the remaining tasks suspended (after a deadlock)
+static void *thread_run(void *);
+static void run_wait_start(void);	// for threads, or workers with -n
+
+static void task_push(struct worker *w, unsigned t)
+{
+	pthread_mutex_lock(&w->lock);
+	assert(w->nb < nb_threads);
+	w->queue[(w->head + w->nb++) % nb_threads] = t;
+	pthread_mutex_unlock(&w->lock);
+}
+
+// Take the next task of w, or else the last one of another worker
+static bool task_pop(struct worker *w, unsigned *t)
+{
+	for (unsigned i = 0; i < pool_size; i++) {
+		struct worker *v = workers + (w - workers + i) % pool_size;
+		pthread_mutex_lock(&v->lock);
+		bool const found = v->nb > 0;
+		if (found && v == w) {
+			*t = v->queue[v->head];
+			v->head = (v->head + 1) % nb_threads;
+			v->nb --;
+		} else if (found) {
+			*t = v->queue[(v->head + --v->nb) % nb_threads];
+		}
+		pthread_mutex_unlock(&v->lock);
+		if (found) return true;
+	}
+	return false;
+}
+
+static void task_nap(uint64_t ns)
+{
+	struct timespec ts;
+	timespec_from_ns(&ts, ns);
+	nanosleep(&ts, NULL);
+}
+
+// Let other tasks run (or other threads, without -n)
+static void task_yield(unsigned t)
+{
+	if (! nb_workers) {
+		sched_yield();
+		return;
+	}
+	struct task *k = tasks + t;
+	swapcontext(&k->uc, &k->worker->sched);
+}
+
+static void task_usleep(unsigned t, unsigned usec)
+{
+	if (! nb_workers) {
+		usleep(usec);
+		return;
+	}
+	tasks[t].wake = now_ns() + usec * 1000ULL;
+	task_yield(t);
+}
+
+static void task_entry(int t)
+{
+	thread_run((void *)(intptr_t)t);
+	__atomic_fetch_sub(&tasks_left, 1, __ATOMIC_RELEASE);
+	tasks[t].finished = true;
+	setcontext(&tasks[t].worker->sched);
+}
+
+static void *worker_run(void *idx)
+{
+	struct worker *w = workers + (intptr_t)idx;
+	run_wait_start();
+
+	unsigned nb_asleep = 0;	// tasks found asleep in a row
+	while (__atomic_load_n(&tasks_left, __ATOMIC_ACQUIRE) > 0 && ! __atomic_load_n(&workers_stop, __ATOMIC_RELAXED)) {
+		unsigned t;
+		if (! task_pop(w, &t)) {
+			task_nap(TASK_IDLE_NSEC);
+			continue;
+		}
+		struct task *k = tasks + t;
+		uint64_t const now = now_ns();
+		if (k->wake > now) {
+			task_push(w, t);
+			if (++nb_asleep >= nb_threads) {
+				task_nap(k->wake - now < TASK_IDLE_NSEC ? k->wake - now : TASK_IDLE_NSEC);
+				nb_asleep = 0;
+			}
+			continue;
+		}
+		nb_asleep = 0;
+		k->worker = w;
+		swapcontext(&w->sched, &k->uc);
+		if (! k->finished) task_push(w, t);
+	}
+	return NULL;
+}
+
+static void tasks_fini(void)
+{
+	long const page = sysconf(_SC_PAGESIZE);
+	if (tasks) for (unsigned t = 0; t < nb_threads; t++) {
+		if (tasks[t].stack) munmap(tasks[t].stack - page, task_stack_size + page);
+	}
+	free(tasks);
+	tasks = NULL;
+	if (workers) for (unsigned w = 0; w < pool_size; w++) {
+		pthread_mutex_destroy(&workers[w].lock);
+		free(workers[w].queue);
+	}
+	free(workers);
+	workers = NULL;
+}
+
+// Create the tasks and spread them over the workers
+static int tasks_init(void)
+{
+	pool_size = nb_workers < nb_threads ? nb_workers : nb_threads;
+	tasks_left = nb_threads;
+	workers_stop = false;
+	tasks = calloc(nb_threads, sizeof(*tasks));
+	if (0 != posix_memalign((void **)&workers, CACHE_LINE, pool_size * sizeof(*workers))) workers = NULL;
+	if (! tasks || ! workers) return -1;
+	memset(workers, 0, pool_size * sizeof(*workers));
+	for (unsigned w = 0; w < pool_size; w++) {
+		pthread_mutex_init(&workers[w].lock, NULL);
+		workers[w].queue = malloc(nb_threads * sizeof(*workers[w].queue));
+		if (! workers[w].queue) return -1;
+	}
+	long const page = sysconf(_SC_PAGESIZE);
+	/* The cycle checks of Matrix, SparseMatrix and Sharded recurse once per thread along a
+	 * chain, and Sharded has a set of nb_claimed locks in each frame. Pages are only backed
+	 * once touched, so be generous. */
+	task_stack_size = TASK_STACK_SIZE + (size_t)nb_threads * (TASK_FRAME_SIZE + nb_claimed * sizeof(unsigned));
+	task_stack_size = (task_stack_size + page - 1) / page * page;
+	for (unsigned t = 0; t < nb_threads; t++) {
+		struct task *k = tasks + t;
+		char *p = mmap(NULL, task_stack_size + page, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE|MAP_STACK, -1, 0);
+		if (p == MAP_FAILED) return -1;
+		(void)mprotect(p, page, PROT_NONE);
+		k->stack = p + page;
+		getcontext(&k->uc);
+		k->uc.uc_stack.ss_sp = k->stack;
+		k->uc.uc_stack.ss_size = task_stack_size;
+		k->uc.uc_link = NULL;
+		makecontext(&k->uc, (void (*)(void))task_entry, 1, (int)t);
+		struct worker *w = workers + t % pool_size;
+		w->queue[w->nb++] = t;
+	}
+	return 0;
+}
+
+/*
+ * Lock primitives
+ * The locks the methods are about can be backed by several primitives, so that the cost of the
+ * deadlock handling can be told apart from the cost of the lock itself. Timed attempts are given
+ * an absolute CLOCK_MONOTONIC deadline.
+ */
+
+#if defined(__x86_64__) || defined(__i386__)
+#	define CPU_RELAX() __builtin_ia32_pause()
+#else
+#	define CPU_RELAX() do {} while (0)
+#endif
+
+#define SPINS_BEFORE_WAIT 100
+#define PADDED(sz) (((sz) + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE)
+
+// Wait while *addr is val or until the deadline (0 for none). Returns 0, EAGAIN, EINTR or ETIMEDOUT.
+static int futex_wait(uint32_t *addr, uint32_t val, uint64_t deadline)
+{
+	struct timespec ts;
+	if (deadline) timespec_from_ns(&ts, deadline);
+	if (0 == syscall(SYS_futex, addr, FUTEX_WAIT_BITSET_PRIVATE, val, deadline ? &ts : NULL, NULL, FUTEX_BITSET_MATCH_ANY)) {
+		return 0;
+	}
+	return errno;
+}
+
+static void futex_wake(uint32_t *addr)
+{
+	(void)syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+// Plain pthread mutexes, packed or each on its own cache line(s)
+
+static void pm_init(void *m)
+{
+	pthread_mutex_init(m, NULL);
+}
+
+static void pm_destroy(void *m)
+{
+	pthread_mutex_destroy(m);
+}
+
+static void pm_lock(unsigned t, void *m)
+{
+	(void)t;
+	if (0 != pthread_mutex_lock(m)) {
+		assert(!"Cannot take lock?!");
+	}
+}
+
+static int pm_trylock(unsigned t, void *m)
+{
+	(void)t;
+	return pthread_mutex_trylock(m);
+}
+
+static int pm_timedlock(unsigned t, void *m, uint64_t deadline)
+{
+	(void)t;
+	struct timespec ts;
+	timespec_from_ns(&ts, deadline);
+	return pthread_mutex_clocklock(m, CLOCK_MONOTONIC, &ts);
+}
+
+static void pm_unlock(unsigned t, void *m)
+{
+	(void)t;
+	(void)pthread_mutex_unlock(m);
+}
+
+// 4 bytes futex lock: 0 when free, 1 when locked, 2 when locked and there may be waiters
+
+static void fx_init(void *f)
+{
+	*(uint32_t *)f = 0;
+}
+
+static int fx_trylock(unsigned t, void *f)
+{
+	(void)t;
+	uint32_t c = 0;
+	return __atomic_compare_exchange_n((uint32_t *)f, &c, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED) ? 0 : EBUSY;
+}
+
+static int fx_timedlock(unsigned t, void *f, uint64_t deadline)
+{
+	for (unsigned s = 0; s < SPINS_BEFORE_WAIT; s++) {
+		if (0 == fx_trylock(t, f)) return 0;
+		CPU_RELAX();
+	}
+	while (0 != __atomic_exchange_n((uint32_t *)f, 2, __ATOMIC_ACQUIRE)) {
+		if (ETIMEDOUT == futex_wait(f, 2, deadline)) return ETIMEDOUT;
+	}
+	return 0;
+}
+
+static void fx_lock(unsigned t, void *f)
+{
+	if (0 != fx_timedlock(t, f, 0)) {
+		assert(!"Cannot take lock?!");
+	}
+}
+
+static void fx_unlock(unsigned t, void *f)
+{
+	(void)t;
+	if (2 == __atomic_exchange_n((uint32_t *)f, 0, __ATOMIC_RELEASE)) futex_wake(f);
+}
+
+/* MCS queue lock: each waiter spins on its own node, then sleeps on it.
+ * A thread needs one node per lock it holds or waits for, hence nb_claimed nodes per thread.
+ * Queued waiters cannot leave the queue, so timed attempts poll with trylock instead. */
+
+static struct mcs_node {
+	struct mcs_node *next;
+	uint32_t locked;	// 1 while waiting, 2 once sleeping on it, 0 when handed the lock
+	bool in_use;	// only accessed by the owning thread
+} __attribute__((aligned(CACHE_LINE))) *mcs_nodes;
+
+struct mcs_lock {
+	struct mcs_node *tail;
+	struct mcs_node *owner;	// only accessed by the holder
+};
+
+static int mcs_setup(void)
+{
+	if (0 != posix_memalign((void **)&mcs_nodes, CACHE_LINE, (size_t)nb_threads * nb_claimed * sizeof(*mcs_nodes))) {
+		mcs_nodes = NULL;
+		return -1;
+	}
+	memset(mcs_nodes, 0, (size_t)nb_threads * nb_claimed * sizeof(*mcs_nodes));
+	return 0;
+}
+
+static void mcs_teardown(void)
+{
+	free(mcs_nodes);
+	mcs_nodes = NULL;
+}
+
+static void mcs_init(void *m)
+{
+	memset(m, 0, sizeof(struct mcs_lock));
+}
+
+static struct mcs_node *mcs_node_get(unsigned t)
+{
+	struct mcs_node *n = mcs_nodes + t * nb_claimed;
+	while (n->in_use) {
+		n ++;
+		assert(n < mcs_nodes + (t+1) * nb_claimed);
+	}
+	n->in_use = true;
+	n->next = NULL;
+	n->locked = 1;
+	return n;
+}
+
+static void mcs_lock(unsigned t, void *m)
+{
+	struct mcs_lock *l = m;
+	struct mcs_node *n = mcs_node_get(t);
+	struct mcs_node *prev = __atomic_exchange_n(&l->tail, n, __ATOMIC_ACQ_REL);
+	if (prev) {
+		__atomic_store_n(&prev->next, n, __ATOMIC_RELEASE);
+		uint32_t c = 1;
+		for (unsigned s = 0; s < SPINS_BEFORE_WAIT && c; s++) {
+			CPU_RELAX();
+			c = __atomic_load_n(&n->locked, __ATOMIC_ACQUIRE);
+		}
+		if (c && __atomic_compare_exchange_n(&n->locked, &c, 2, false, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+			while (0 != __atomic_load_n(&n->locked, __ATOMIC_ACQUIRE)) futex_wait(&n->locked, 2, 0);
+		}
+	}
+	l->owner = n;
+}
+
+static int mcs_trylock(unsigned t, void *m)
+{
+	struct mcs_lock *l = m;
+	struct mcs_node *n = mcs_node_get(t), *expected = NULL;
+	if (! __atomic_compare_exchange_n(&l->tail, &expected, n, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+		n->in_use = false;
+		return EBUSY;
+	}
+	l->owner = n;
+	return 0;
+}
+
+static int mcs_timedlock(unsigned t, void *m, uint64_t deadline)
+{
+	while (0 != mcs_trylock(t, m)) {
+		if (now_ns() >= deadline) return ETIMEDOUT;
+		sched_yield();
+	}
+	return 0;
+}
+
+static void mcs_unlock(unsigned t, void *m)
+{
+	(void)t;
+	struct mcs_lock *l = m;
+	struct mcs_node *n = l->owner, *next = __atomic_load_n(&n->next, __ATOMIC_ACQUIRE);
+	if (! next) {
+		struct mcs_node *expected = n;
+		if (__atomic_compare_exchange_n(&l->tail, &expected, NULL, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+			n->in_use = false;
+			return;
+		}
+		while (! (next = __atomic_load_n(&n->next, __ATOMIC_ACQUIRE))) sched_yield();	// it's enqueuing
+	}
+	if (2 == __atomic_exchange_n(&next->locked, 0, __ATOMIC_RELEASE)) futex_wake(&next->locked);
+	n->in_use = false;
+}
+
+/* pthread rwlocks, the only ones with a shared mode. Methods rely on readers not queuing behind
+ * waiting writers (glibc's default), that would make readers wait for each other. */
+
+static void rw_init(void *rw)
+{
+	pthread_rwlock_init(rw, NULL);
+}
+
+static void rw_destroy(void *rw)
+{
+	pthread_rwlock_destroy(rw);
+}
+
+static void rw_lock(unsigned t, void *rw)
+{
+	(void)t;
+	if (0 != pthread_rwlock_wrlock(rw)) {
+		assert(!"Cannot take lock?!");
+	}
+}
+
+static void rw_rdlock(unsigned t, void *rw)
+{
+	(void)t;
+	if (0 != pthread_rwlock_rdlock(rw)) {
+		assert(!"Cannot take lock?!");
+	}
+}
+
+static int rw_trylock(unsigned t, void *rw)
+{
+	(void)t;
+	return pthread_rwlock_trywrlock(rw);
+}
+
+static int rw_tryrdlock(unsigned t, void *rw)
+{
+	(void)t;
+	return pthread_rwlock_tryrdlock(rw);
+}
+
+static int rw_timedlock(unsigned t, void *rw, uint64_t deadline)
+{
+	(void)t;
+	struct timespec ts;
+	timespec_from_ns(&ts, deadline);
+	return pthread_rwlock_clockwrlock(rw, CLOCK_MONOTONIC, &ts);
+}
+
+static void rw_unlock(unsigned t, void *rw)
+{
+	(void)t;
+	(void)pthread_rwlock_unlock(rw);
+}
+
+static struct primitive {
+	char const *name;
+	size_t size;	// of one lock, which are stored that far apart
+	int (*setup)(void);	// optional, allocates the primitive private state
+	void (*teardown)(void);
+	void (*init)(void *);
+	void (*destroy)(void *);	// optional
+	void (*lock)(unsigned, void *);
+	int (*trylock)(unsigned, void *);	// returns 0 or EBUSY
+	int (*timedlock)(unsigned, void *, uint64_t);	// returns 0 or ETIMEDOUT
+	void (*unlock)(unsigned, void *);	// from either mode
+	void (*rdlock)(unsigned, void *);	// optional, shared claims are then exclusive
+	int (*tryrdlock)(unsigned, void *);	// along with rdlock
+	bool migrates;	// can be unlocked from another OS thread than the one that took it (for -n)
+} const primitives[] = {
+	{ "pthread", sizeof(pthread_mutex_t), NULL, NULL, pm_init, pm_destroy, pm_lock, pm_trylock, pm_timedlock, pm_unlock, NULL, NULL, true },
+	{ "padded", PADDED(sizeof(pthread_mutex_t)), NULL, NULL, pm_init, pm_destroy, pm_lock, pm_trylock, pm_timedlock, pm_unlock, NULL, NULL, true },
+	{ "futex", sizeof(uint32_t), NULL, NULL, fx_init, NULL, fx_lock, fx_trylock, fx_timedlock, fx_unlock, NULL, NULL, true },
+	{ "mcs", sizeof(struct mcs_lock), mcs_setup, mcs_teardown, mcs_init, NULL, mcs_lock, mcs_trylock, mcs_timedlock, mcs_unlock, NULL, NULL, true },
+	// glibc tells a writer unlocking from a reader by its thread id
+	{ "rwlock", sizeof(pthread_rwlock_t), NULL, NULL, rw_init, rw_destroy, rw_lock, rw_trylock, rw_timedlock, rw_unlock, rw_rdlock, rw_tryrdlock, false },
+};
+
+#define LOCK_AT(l) ((void *)(locks + (size_t)(l) * primitives[primitive].size))
+
+static void prim_lock(unsigned t, unsigned l)
+{
+	if (nb_workers) {	// do not block the worker
+		while (0 != primitives[primitive].trylock(t, LOCK_AT(l))) task_yield(t);
+		return;
+	}
+	primitives[primitive].lock(t, LOCK_AT(l));
+}
+
+static int prim_trylock(unsigned t, unsigned l)
+{
+	return primitives[primitive].trylock(t, LOCK_AT(l));
+}
+
+static int prim_timedlock(unsigned t, unsigned l, uint64_t deadline)
+{
+	int err = 0;
+	__atomic_store_n(&thread_ctxs[t].timed_wait, true, __ATOMIC_RELAXED);
+	if (nb_workers) {
+		while (0 != primitives[primitive].trylock(t, LOCK_AT(l))) {
+			if (now_ns() >= deadline) {
+				err = ETIMEDOUT;
+				break;
+			}
+			task_yield(t);
+		}
+	} else {
+		err = primitives[primitive].timedlock(t, LOCK_AT(l), deadline);
+	}
+	__atomic_store_n(&thread_ctxs[t].timed_wait, false, __ATOMIC_RELAXED);
+	return err;
+}
+
+static void prim_unlock(unsigned t, unsigned l)
+{
+	primitives[primitive].unlock(t, LOCK_AT(l));
+}
+
+// Whether a shared claim can really be shared, counting those that cannot
+static bool prim_shared(unsigned t, bool shared)
+{
+	if (shared && ! primitives[primitive].rdlock) {
+		COUNTER_INC(thread_ctxs[t].nb_excl_shared);
+		return false;
+	}
+	return shared;
+}
+
+static void prim_lock_mode(unsigned t, unsigned l, bool shared)
+{
+	if (! prim_shared(t, shared)) prim_lock(t, l);
+	else if (nb_workers) {
+		while (0 != primitives[primitive].tryrdlock(t, LOCK_AT(l))) task_yield(t);
+	} else primitives[primitive].rdlock(t, LOCK_AT(l));
+}
+
+/*
+ * Just take it method : will quickly leads to deadlock
+ */
+
+static int just_lock(unsigned t, unsigned l)
+{
+	prim_lock(t, l);
+	return 0;
+}
+
+static void just_unlock(unsigned t, unsigned l)
+{
+	prim_unlock(t, l);
+}
+
+/*
+ * Dependency tracking (simple method)
+ * Requires an additional global lock, but prevents deadlocks instead of detecting them afterward.
+ * In number of threads or number of locks is really high a sparse representation would be required.
+ */
+
+static pthread_mutex_t m_lock = PTHREAD_MUTEX_INITIALIZER;
+#define NB_BITS_PER_CELL 64
+static uint64_t *thread_wq;	// list of locks we wait or hold, set under m_lock.
+static unsigned thread_stride;	// log2 of the stride from one row to the next in the lock matrix
+/* Bits are only ever set with m_lock, but can be cleared without: this can only remove edges
+ * from under is_looping's feet, which would then at worst see a loop that's already gone,
+ * and the graph stays cycle free. Hence the atomic accesses. */
+#define THREAD_CELL(t, l)  (thread_wq + ((t) << thread_stride) + (l)/NB_BITS_PER_CELL)
+#define THREAD_BIT(l)      (1ULL << ((l)%NB_BITS_PER_CELL))
+#define THREAD_HOLD(t, l)  (__atomic_load_n(THREAD_CELL(t, l), __ATOMIC_RELAXED) & THREAD_BIT(l))
+#define THREAD_HOLD_GROUP(t, l)  __atomic_load_n(THREAD_CELL(t, l), __ATOMIC_RELAXED)
+#define THREAD_SET(t, l)   __atomic_fetch_or(THREAD_CELL(t, l), THREAD_BIT(l), __ATOMIC_RELAXED)
+#define THREAD_CLEAR(t, l) __atomic_fetch_and(THREAD_CELL(t, l), ~THREAD_BIT(l), __ATOMIC_RELEASE)
+/* Same layout for shared claims. Readers do not wait for each other so there is no edge between
+ * two readers of a lock. Bits are set before and cleared after the ones in thread_wq. */
+static uint64_t *thread_rd;
+#define READ_CELL(t, l)    (thread_rd + ((t) << thread_stride) + (l)/NB_BITS_PER_CELL)
+#define THREAD_READ(t, l)  (__atomic_load_n(READ_CELL(t, l), __ATOMIC_RELAXED) & THREAD_BIT(l))
+#define READ_SET(t, l)     __atomic_fetch_or(READ_CELL(t, l), THREAD_BIT(l), __ATOMIC_RELAXED)
+#define READ_CLEAR(t, l)   __atomic_fetch_and(READ_CELL(t, l), ~THREAD_BIT(l), __ATOMIC_RELAXED)
+
+/* Locks held by each thread with their recursion count, used by this method and OrderedLock.
+ * A thread never holds more than nb_claimed distinct locks so a small per thread stack is enough,
+ * and as it's only accessed by its owner rows are padded to avoid false sharing. */
+struct held_set {
+	unsigned nb;
+	struct held_lock {
+		unsigned lock, count;
+	} held[];	// nb_claimed entries, in locking order
+};
+static char *held_sets;
+static size_t held_stride;	// in bytes, a multiple of CACHE_LINE
+#define HELD_SET(t) ((struct held_set *)(held_sets + (t) * held_stride))
+
+static int cmp_unsigned(void const *a_, void const *b_)
+{
+	unsigned const a = *(unsigned const *)a_, b = *(unsigned const *)b_;
+	return a < b ? -1 : a > b;
+}
+
+static unsigned upper_multiple_of(unsigned n, unsigned m)
+{
+	unsigned u = m;
+	unsigned l = 1;
+	while (u < n) {
+		u += m;
+		l ++;
+	}
+	return l;
+}
+
+static int held_init(void)
+{
+	held_stride = CACHE_LINE * upper_multiple_of(sizeof(struct held_set) + nb_claimed * sizeof(struct held_lock), CACHE_LINE);
+	held_sets = rows_alloc(held_stride);
+	return held_sets ? 0 : -1;
+}
+
+static void held_fini(void)
+{
+	rows_free(held_sets);
+	held_sets = NULL;
+}
+
+// Most recent first, since that's what's usually unlocked
+static struct held_lock *held_find(struct held_set *hs, unsigned l)
+{
+	for (unsigned i = hs->nb; i --; ) {
+		if (hs->held[i].lock == l) return hs->held+i;
+	}
+	return NULL;
+}
+
+static void held_push(struct held_set *hs, unsigned l)
+{
+	assert(hs->nb < nb_claimed);
+	hs->held[hs->nb].lock = l;
+	hs->held[hs->nb].count = 1;
+	hs->nb ++;
+}
+
+// Returns the remaining count, removing the entry (keeping the order) when it reaches 0
+static unsigned held_release(struct held_set *hs, unsigned l)
+{
+	struct held_lock *h = held_find(hs, l);
+	assert(h);
+	if (--h->count > 0) return h->count;
+	hs->nb --;
+	memmove(h, h+1, (hs->held + hs->nb - h) * sizeof(*h));
+	return 0;
+}
+
+// starting from (t, l) can we go back to target thread?
+// As we are supposed to be cycle free we do not have to tag the matrix along the way.
+static bool is_looping(unsigned t, unsigned l, unsigned target)
+{
+	for (unsigned ll = 0; ll < nb_locks; ll ++) {
+		if (0 == (ll&(NB_BITS_PER_CELL-1))) {
+			if (! THREAD_HOLD_GROUP(t, ll)) {
+				ll += NB_BITS_PER_CELL-1;
+				continue;
+			}
+		}
+		if (! THREAD_HOLD(t, ll)) continue;
+		if (ll == l) continue;	// we are not allowed to proceed to where we come from
+		for (unsigned tt = 0; tt < nb_threads; tt ++) {
+			if (! THREAD_HOLD(tt, ll)) continue;
+			if (tt == t) continue;
+			if (THREAD_READ(t, ll) && THREAD_READ(tt, ll)) continue;
+			if (tt == target) return true;
+			if (is_looping(tt, ll, target)) return true;
+		}
+	}
+
+	return false;
+}
+
+static int matrix_lock_mode(unsigned t, unsigned l, bool shared)
+{
+	struct held_set *hs = HELD_SET(t);
+	struct held_lock *h = held_find(hs, l);
+	if (h) {
+		h->count ++;
+#		ifndef NDEBUG
+		printf("thread %u: already got lock %u\n", t, l);
+#		endif
+		return 0;
+	}
+
+	if (0 != pthread_mutex_lock(&m_lock)) {
+		assert(!"Cannot lock m_lock!?");
+	}
+
+	assert(! THREAD_HOLD(t, l));
+
+	for (unsigned tt = 0; tt < nb_threads; tt ++) {
+		if (! THREAD_HOLD(tt, l)) continue;
+		if (shared && THREAD_READ(tt, l)) continue;
+		if (is_looping(tt, l, t)) {
+#			ifndef NDEBUG
+			printf("thread %u: lock %u would deadlock\n", t, l);
+#			endif
+			pthread_mutex_unlock(&m_lock);
+
+			return -1;
+		}
+	}
+
+#	ifndef NDEBUG
+	printf("thread %u: can safely wait for lock %u\n", t, l);
+#	endif
+	if (shared) READ_SET(t, l);
+	THREAD_SET(t, l);
+	pthread_mutex_unlock(&m_lock);	// since I've said that I'm waiting for the lock I can safely release m_lock
+
+	held_push(hs, l);
+	prim_lock_mode(t, l, shared);
+	return 0;
+}
+
+static int matrix_lock(unsigned t, unsigned l)
+{
+	return matrix_lock_mode(t, l, false);
+}
+
+static int matrix_lock_shared(unsigned t, unsigned l)
+{
+	// Readers are not connected, so they must really share the lock
+	return matrix_lock_mode(t, l, prim_shared(t, true));
+}
+
+static void matrix_unlock(unsigned t, unsigned l)
+{
+	if (held_release(HELD_SET(t), l) > 0) {
+		return;
+	}
+
+	THREAD_CLEAR(t, l);	// no need for m_lock, see above
+	READ_CLEAR(t, l);
+
+	prim_unlock(t, l);
+}
+
+// Register the whole set with a single m_lock section, rejecting it as a whole (MatrixSet only)
+static int matrix_lock_set(unsigned t, unsigned const *set, bool const *shared, unsigned n)
+{
+	bool fresh[n];	// locks we did not already have
+	if (shared && ! primitives[primitive].rdlock) {	// as in matrix_lock_shared
+		for (unsigned i = 0; i < n; i ++) (void)prim_shared(t, shared[i]);
+		shared = NULL;
+	}
+
+	if (0 != pthread_mutex_lock(&m_lock)) {
+		assert(!"Cannot lock m_lock!?");
+	}
+
+	for (unsigned i = 0; i < n; i ++) {
+		unsigned const l = set[i];
+		fresh[i] = ! THREAD_HOLD(t, l);	// we may have it already, or from earlier in the set
+		if (! fresh[i]) continue;
+		bool const rd = shared && shared[i];
+		for (unsigned tt = 0; tt < nb_threads; tt ++) {
+			if (! THREAD_HOLD(tt, l)) continue;
+			if (rd && THREAD_READ(tt, l)) continue;
+			if (is_looping(tt, l, t)) {
+#				ifndef NDEBUG
+				printf("thread %u: lock %u would deadlock\n", t, l);
+#				endif
+				while (i --) {
+					if (! fresh[i]) continue;
+					THREAD_CLEAR(t, set[i]);
+					READ_CLEAR(t, set[i]);
+				}
+				pthread_mutex_unlock(&m_lock);
+				return -1;
+			}
+		}
+		if (rd) READ_SET(t, l);
+		THREAD_SET(t, l);
+	}
+
+	pthread_mutex_unlock(&m_lock);
+
+	struct held_set *hs = HELD_SET(t);
+	for (unsigned i = 0; i < n; i ++) {
+		unsigned const l = set[i];
+		if (! fresh[i]) {
+			held_find(hs, l)->count ++;
+			continue;
+		}
+		held_push(hs, l);
+		prim_lock_mode(t, l, shared && shared[i]);
+	}
+	return 0;
+}
+
+static int matrix_init(void)
+{
+	unsigned const nb_cells = upper_multiple_of(nb_locks, NB_BITS_PER_CELL);
+	thread_stride = 0;
+	while ((1U << thread_stride) < nb_cells) thread_stride ++;
+	thread_wq = rows_alloc(sizeof(*thread_wq) << thread_stride);
+	thread_rd = rows_alloc(sizeof(*thread_rd) << thread_stride);
+	if (! thread_wq || ! thread_rd) return -1;
+	return held_init();
+}
+
+static void matrix_fini(void)
+{
+	rows_free(thread_wq);
+	thread_wq = NULL;
+	rows_free(thread_rd);
+	thread_rd = NULL;
+	held_fini();
+}
+
+/*
+ * Dependency tracking (sparse method)
+ * Same algorithm than above, but the wait-for graph is stored as a list of waiters/holders per lock
+ * plus a small set of claimed locks per thread, so that memory usage does not depend on
+ * nb_threads * nb_locks. Recursion counts are kept in the per thread set as well.
+ */
+
+struct sp_node {	// an edge of the graph: thread waits for or holds lock
+	struct sp_node *prev, *next;	// in the list of its lock (protected by m_lock)
+	unsigned thread, lock;
+	unsigned count;	// recursion count, 0 if the slot is free (only accessed by the thread itself)
+};
+static struct sp_node **sp_lock_list;	// per lock list of waiters/holders
+static struct sp_node *sp_slots;	// nb_claimed slots per thread
+
+static struct sp_node *sp_find(unsigned t, unsigned l)
+{
+	struct sp_node *slots = sp_slots + t * nb_claimed;
+	for (unsigned s = 0; s < nb_claimed; s ++) {
+		if (slots[s].count > 0 && slots[s].lock == l) return slots+s;
+	}
+	return NULL;
+}
+
+// Same as is_looping, walking only the edges that exist.
+static bool sp_is_looping(unsigned t, unsigned l, unsigned target)
+{
+	struct sp_node *slots = sp_slots + t * nb_claimed;
+	for (unsigned s = 0; s < nb_claimed; s ++) {
+		if (slots[s].count == 0) continue;
+		unsigned const ll = slots[s].lock;
+		if (ll == l) continue;	// we are not allowed to proceed to where we come from
+		for (struct sp_node *n = sp_lock_list[ll]; n; n = n->next) {
+			if (n->thread == t) continue;
+			if (n->thread == target) return true;
+			if (sp_is_looping(n->thread, ll, target)) return true;
+		}
+	}
+
+	return false;
+}
+
+static int sparse_lock(unsigned t, unsigned l)
+{
+	struct sp_node *node = sp_find(t, l);
+	if (node) {
+		node->count ++;
+#		ifndef NDEBUG
+		printf("thread %u: already got lock %u\n", t, l);
+#		endif
+		return 0;
+	}
+
+	if (0 != pthread_mutex_lock(&m_lock)) {
+		assert(!"Cannot lock m_lock!?");
+	}
+
+	for (struct sp_node *n = sp_lock_list[l]; n; n = n->next) {
+		if (sp_is_looping(n->thread, l, t)) {
+#			ifndef NDEBUG
+			printf("thread %u: lock %u would deadlock\n", t, l);
+#			endif
+			pthread_mutex_unlock(&m_lock);
+
+			return -1;
+		}
+	}
+
+#	ifndef NDEBUG
+	printf("thread %u: can safely wait for lock %u\n", t, l);
+#	endif
+	struct sp_node *slots = sp_slots + t * nb_claimed;
+	for (unsigned s = 0; ! node && s < nb_claimed; s ++) {	// look for a free slot
+		if (slots[s].count == 0) node = slots+s;
+	}
+	assert(node);
+	node->thread = t;
+	node->lock = l;
+	node->count = 1;
+	node->prev = NULL;
+	node->next = sp_lock_list[l];
+	if (node->next) node->next->prev = node;
+	sp_lock_list[l] = node;
+	pthread_mutex_unlock(&m_lock);
+
+	prim_lock(t, l);
+	return 0;
+}
+
+static void sparse_unlock(unsigned t, unsigned l)
+{
+	struct sp_node *node = sp_find(t, l);
+	assert(node);
+	if (--node->count > 0) {
+		return;
+	}
+
+	if (0 != pthread_mutex_lock(&m_lock)) {
+		assert(!"Cannot lock m_lock!?");
+	}
+
+	if (node->prev) node->prev->next = node->next;
+	else sp_lock_list[l] = node->next;
+	if (node->next) node->next->prev = node->prev;
+
+	pthread_mutex_unlock(&m_lock);
+
+	prim_unlock(t, l);
+}
+
+static int sparse_init(void)
+{
+	sp_lock_list = calloc(nb_locks, sizeof(*sp_lock_list));
+	sp_slots = calloc((size_t)nb_threads * nb_claimed, sizeof(*sp_slots));
+	return sp_lock_list && sp_slots ? 0 : -1;
+}
+
+static void sparse_fini(void)
+{
+	free(sp_lock_list);
+	sp_lock_list = NULL;
+	free(sp_slots);
+	sp_slots = NULL;
+}
+
+/*
+ * Dependency tracking (incremental method)
+ * Here the wait-for graph is directed: a thread points to the lock it waits for, and a lock points
+ * to the thread holding it, so that a cycle is an actual deadlock. We maintain a topological order
+ * of all nodes (Pearce-Kelly): an edge that agrees with the order is inserted at no cost, otherwise
+ * only the nodes that sit between its two ends in the order are visited and reordered.
+ * As each node has at most one successor the forward search is a mere walk.
+ * Still requires m_lock, but the time spent holding it no longer depends on nb_threads * nb_locks.
+ */
+
+#define PK_NONE UINT_MAX
+static unsigned *pk_ord;	// position of each node in the topological order (threads first, then locks)
+static unsigned *pk_wait;	// per thread, the lock it waits for (or PK_NONE)
+static unsigned *pk_wnext, *pk_wprev;	// per thread, links in the waiter list of pk_wait
+static unsigned *pk_waiters;	// per lock, first waiter (or PK_NONE)
+static unsigned *pk_holder;	// per lock, the thread holding it (or PK_NONE)
+static struct pk_held {
+	unsigned lock, count;	// count is the recursion count, 0 if the slot is free
+} *pk_held;	// nb_claimed slots per thread (only accessed by the thread itself)
+static unsigned *pk_delta, *pk_pos;	// scratch space for reordering
+static bool *pk_mark;
+// All of the above but pk_held are protected by m_lock.
+
+#define PK_LOCK_NODE(l) (nb_threads + (l))
+
+static unsigned pk_next(unsigned n)
+{
+	if (n < nb_threads) return pk_wait[n] == PK_NONE ? PK_NONE : PK_LOCK_NODE(pk_wait[n]);
+	return pk_holder[n - nb_threads];
+}
+
+static int pk_cmp_ord(void const *a_, void const *b_)
+{
+	unsigned const a = pk_ord[*(unsigned const *)a_], b = pk_ord[*(unsigned const *)b_];
+	return a < b ? -1 : a > b;
+}
+
+
+// Collects in pk_delta, from index nb, all nodes reaching x (included) placed after lb in the order.
+static unsigned pk_backward(unsigned x, unsigned lb, unsigned nb)
+{
+	unsigned const start = nb;
+	pk_delta[nb++] = x;
+	pk_mark[x] = true;
+	for (unsigned i = start; i < nb; i ++) {	// breadth first, pk_delta being the queue
+		unsigned const n = pk_delta[i];
+		if (n < nb_threads) {	// predecessors of a thread are the locks it holds
+			struct pk_held const *held = pk_held + n * nb_claimed;
+			for (unsigned s = 0; s < nb_claimed; s ++) {
+				if (held[s].count == 0) continue;
+				unsigned const p = PK_LOCK_NODE(held[s].lock);
+				if (pk_holder[held[s].lock] != n || pk_mark[p] || pk_ord[p] <= lb) continue;
+				pk_mark[p] = true;
+				pk_delta[nb++] = p;
+			}
+		} else {	// predecessors of a lock are its waiters
+			for (unsigned p = pk_waiters[n - nb_threads]; p != PK_NONE; p = pk_wnext[p]) {
+				if (pk_mark[p] || pk_ord[p] <= lb) continue;
+				pk_mark[p] = true;
+				pk_delta[nb++] = p;
+			}
+		}
+	}
+	return nb;
+}
+
+// Adds edge x->y unless it would close a cycle. Returns false in that case.
+static bool pk_insert(unsigned x, unsigned y)
+{
+	unsigned const lb = pk_ord[y], ub = pk_ord[x];
+	if (lb > ub) return true;	// already in order
+
+	// Forward: follow the path from y, up to ub
+	unsigned nf = 0;
+	for (unsigned n = y; n != PK_NONE && pk_ord[n] <= ub; n = pk_next(n)) {
+		if (n == x) return false;
+		pk_delta[nf++] = n;
+	}
+	// Backward: all nodes reaching x down to lb
+	unsigned const nb = pk_backward(x, lb, nf);
+
+	// Reorder: reuse the same positions, placing the backward set before the forward set
+	qsort(pk_delta, nf, sizeof(*pk_delta), pk_cmp_ord);
+	qsort(pk_delta+nf, nb-nf, sizeof(*pk_delta), pk_cmp_ord);
+	for (unsigned i = 0; i < nb; i ++) {
+		pk_pos[i] = pk_ord[pk_delta[i]];
+		pk_mark[pk_delta[i]] = false;
+	}
+	qsort(pk_pos, nb, sizeof(*pk_pos), cmp_unsigned);
+	unsigned p = 0;
+	for (unsigned i = nf; i < nb; i ++) pk_ord[pk_delta[i]] = pk_pos[p++];
+	for (unsigned i = 0; i < nf; i ++) pk_ord[pk_delta[i]] = pk_pos[p++];
+
+	return true;
+}
+
+static void pk_wait_link(unsigned t, unsigned l)
+{
+	pk_wait[t] = l;
+	pk_wprev[t] = PK_NONE;
+	pk_wnext[t] = pk_waiters[l];
+	if (pk_wnext[t] != PK_NONE) pk_wprev[pk_wnext[t]] = t;
+	pk_waiters[l] = t;
+}
+
+static void pk_wait_unlink(unsigned t)
+{
+	unsigned const l = pk_wait[t];
+	if (pk_wprev[t] != PK_NONE) pk_wnext[pk_wprev[t]] = pk_wnext[t];
+	else pk_waiters[l] = pk_wnext[t];
+	if (pk_wnext[t] != PK_NONE) pk_wprev[pk_wnext[t]] = pk_wprev[t];
+	pk_wait[t] = PK_NONE;
+}
+
+static struct pk_held *pk_find(unsigned t, unsigned l)
+{
+	struct pk_held *held = pk_held + t * nb_claimed;
+	for (unsigned s = 0; s < nb_claimed; s ++) {
+		if (held[s].count > 0 && held[s].lock == l) return held+s;
+	}
+	return NULL;
+}
+
+// Must be called with m_lock, once lock l is actually owned by t
+static void pk_hold(unsigned t, unsigned l)
+{
+	bool const ok = pk_insert(PK_LOCK_NODE(l), t);	// t waits for nothing so this cannot loop
+	assert(ok);
+	(void)ok;
+	pk_holder[l] = t;
+	struct pk_held *held = pk_held + t * nb_claimed;
+	unsigned s;
+	for (s = 0; s < nb_claimed && held[s].count > 0; s ++) ;
+	assert(s < nb_claimed);
+	held[s].lock = l;
+	held[s].count = 1;
+}
+
+static int pk_lock(unsigned t, unsigned l)
+{
+	struct pk_held *held = pk_find(t, l);
+	if (held) {
+		held->count ++;
+#		ifndef NDEBUG
+		printf("thread %u: already got lock %u\n", t, l);
+#		endif
+		return 0;
+	}
+
+	if (0 != pthread_mutex_lock(&m_lock)) {
+		assert(!"Cannot lock m_lock!?");
+	}
+
+	if (0 == prim_trylock(t, l)) {	// fast path: no need to wait
+		pk_hold(t, l);
+		pthread_mutex_unlock(&m_lock);
+		return 0;
+	}
+
+	if (! pk_insert(t, PK_LOCK_NODE(l))) {
+#		ifndef NDEBUG
+		printf("thread %u: lock %u would deadlock\n", t, l);
+#		endif
+		pthread_mutex_unlock(&m_lock);
+		return -1;
+	}
+
+#	ifndef NDEBUG
+	printf("thread %u: can safely wait for lock %u\n", t, l);
+#	endif
+	pk_wait_link(t, l);
+	pthread_mutex_unlock(&m_lock);
+
+	prim_lock(t, l);
+
+	if (0 != pthread_mutex_lock(&m_lock)) {
+		assert(!"Cannot lock m_lock!?");
+	}
+	pk_wait_unlink(t);
+	pk_hold(t, l);
+	pthread_mutex_unlock(&m_lock);
+
+	return 0;
+}
+
+static void pk_unlock(unsigned t, unsigned l)
+{
+	struct pk_held *held = pk_find(t, l);
+	assert(held);
+	if (--held->count > 0) {
+		return;
+	}
+
+	if (0 != pthread_mutex_lock(&m_lock)) {
+		assert(!"Cannot lock m_lock!?");
+	}
+
+	pk_holder[l] = PK_NONE;	// removing an edge keeps the order valid
+
+	pthread_mutex_unlock(&m_lock);
+
+	prim_unlock(t, l);
+}
+
+static int pk_init(void)
+{
+	size_t const nb_nodes = (size_t)nb_threads + nb_locks;
+	pk_ord = malloc(nb_nodes * sizeof(*pk_ord));
+	pk_delta = malloc(nb_nodes * sizeof(*pk_delta));
+	pk_pos = malloc(nb_nodes * sizeof(*pk_pos));
+	pk_mark = calloc(nb_nodes, sizeof(*pk_mark));
+	pk_wait = malloc(nb_threads * sizeof(*pk_wait));
+	pk_wnext = malloc(nb_threads * sizeof(*pk_wnext));
+	pk_wprev = malloc(nb_threads * sizeof(*pk_wprev));
+	pk_waiters = malloc(nb_locks * sizeof(*pk_waiters));
+	pk_holder = malloc(nb_locks * sizeof(*pk_holder));
+	pk_held = calloc((size_t)nb_threads * nb_claimed, sizeof(*pk_held));
+	if (!pk_ord || !pk_delta || !pk_pos || !pk_mark || !pk_wait || !pk_wnext || !pk_wprev ||
+	    !pk_waiters || !pk_holder || !pk_held) return -1;
+
+	for (size_t n = 0; n < nb_nodes; n ++) pk_ord[n] = n;
+	for (unsigned t = 0; t < nb_threads; t ++) pk_wait[t] = PK_NONE;
+	for (unsigned l = 0; l < nb_locks; l ++) pk_waiters[l] = pk_holder[l] = PK_NONE;
+	return 0;
+}
+
+static void pk_fini(void)
+{
+	free(pk_ord); pk_ord = NULL;
+	free(pk_delta); pk_delta = NULL;
+	free(pk_pos); pk_pos = NULL;
+	free(pk_mark); pk_mark = NULL;
+	free(pk_wait); pk_wait = NULL;
+	free(pk_wnext); pk_wnext = NULL;
+	free(pk_wprev); pk_wprev = NULL;
+	free(pk_waiters); pk_waiters = NULL;
+	free(pk_holder); pk_holder = NULL;
+	free(pk_held); pk_held = NULL;
+}
+
+/*
+ * Dependency tracking (sharded method)
+ * Same graph than the sparse method, but instead of m_lock the per lock lists are protected by
+ * striped mutexes and the per thread sets by a per thread mutex. Requesting a lock that no one
+ * else waits for or holds merely adds a leaf to the graph and cannot close a loop, so it does
+ * not need any global lock, and neither does releasing a lock. Only the loop check itself is
+ * serialized, by sh_check_lock, and never needs more than one of the small locks at a time.
+ * Concurrent leaf additions and removals may mislead the walk, but they can only make it see
+ * loops that do not exist, never miss one; so the walk tags the nodes it visits and is
+ * conservative if it meets one twice.
+ */
+
+#define SH_NB_STRIPES 256
+static struct sh_mutex {
+	pthread_mutex_t m;
+} __attribute__((aligned(CACHE_LINE))) sh_stripes[SH_NB_STRIPES], *sh_tlocks;
+#define SH_STRIPE(l) (&sh_stripes[(l) % SH_NB_STRIPES].m)
+
+struct sh_node {	// an edge of the graph: thread waits for or holds lock
+	struct sh_node *prev, *next;	// in the list of its lock (protected by the lock stripe)
+	unsigned thread, lock;
+	bool in_use;	// protected by the thread lock
+	unsigned count;	// recursion count, 0 if the slot is free (only accessed by the thread itself)
+};
+static struct sh_node **sh_lock_list;	// per lock list of waiters/holders (protected by the lock stripe)
+static unsigned *sh_gen;	// per lock, incremented when a leaf is added (protected by the lock stripe)
+static struct sh_node *sh_slots;	// nb_claimed slots per thread
+
+static pthread_mutex_t sh_check_lock = PTHREAD_MUTEX_INITIALIZER;
+// Protected by sh_check_lock:
+static unsigned sh_epoch;
+static unsigned *sh_tseen, *sh_lseen;	// per thread/lock, epoch of last visit
+static unsigned *sh_scratch, sh_scratch_sz, sh_nb_scratch;	// stack of neighbours yet to visit
+
+static void sh_lock(pthread_mutex_t *m)
+{
+	if (0 != pthread_mutex_lock(m)) {
+		assert(!"Cannot lock metadata lock!?");
+	}
+}
+
+// Push all threads waiting for or holding l but t. Returns false if we ran out of space.
+static bool sh_push_threads(unsigned l, unsigned t)
+{
+	bool ok = true;
+	sh_lock(SH_STRIPE(l));
+	for (struct sh_node *n = sh_lock_list[l]; n && ok; n = n->next) {
+		if (n->thread == t) continue;
+		if (sh_nb_scratch >= sh_scratch_sz) ok = false;
+		else sh_scratch[sh_nb_scratch++] = n->thread;
+	}
+	pthread_mutex_unlock(SH_STRIPE(l));
+	return ok;
+}
+
+static bool sh_is_looping(unsigned t, unsigned l, unsigned target)
+{
+	if (sh_tseen[t] == sh_epoch) return true;
+	sh_tseen[t] = sh_epoch;
+
+	unsigned held[nb_claimed], nb_held = 0;
+	sh_lock(&sh_tlocks[t].m);
+	for (unsigned s = 0; s < nb_claimed; s ++) {
+		struct sh_node const *n = sh_slots + t * nb_claimed + s;
+		if (n->in_use && n->lock != l) held[nb_held++] = n->lock;
+	}
+	pthread_mutex_unlock(&sh_tlocks[t].m);
+
+	for (unsigned h = 0; h < nb_held; h ++) {
+		unsigned const ll = held[h];
+		if (sh_lseen[ll] == sh_epoch) return true;
+		sh_lseen[ll] = sh_epoch;
+		unsigned const base = sh_nb_scratch;
+		if (! sh_push_threads(ll, t)) return true;
+		for (unsigned i = base; i < sh_nb_scratch; i ++) {
+			unsigned const tt = sh_scratch[i];
+			if (tt == target) return true;
+			if (sh_is_looping(tt, ll, target)) return true;
+		}
+		sh_nb_scratch = base;
+	}
+
+	return false;
+}
+
+static void sh_link(struct sh_node *node, unsigned l)
+{
+	node->lock = l;
+	node->prev = NULL;
+	node->next = sh_lock_list[l];
+	if (node->next) node->next->prev = node;
+	sh_lock_list[l] = node;
+}
+
+static int sharded_lock(unsigned t, unsigned l)
+{
+	struct sh_node *slots = sh_slots + t * nb_claimed, *node = NULL;
+	for (unsigned s = 0; s < nb_claimed; s ++) {
+		if (slots[s].count > 0 && slots[s].lock == l) {
+			slots[s].count ++;
+#			ifndef NDEBUG
+			printf("thread %u: already got lock %u\n", t, l);
+#			endif
+			return 0;
+		}
+		if (! node && slots[s].count == 0) node = slots+s;
+	}
+	assert(node);
+
+	/* Walks must know about this edge as soon as it's in the list of l, or a concurrent check
+	 * walking through us could miss it. Seeing it before is merely conservative. */
+	sh_lock(&sh_tlocks[t].m);
+	node->lock = l;
+	node->in_use = true;
+	pthread_mutex_unlock(&sh_tlocks[t].m);
+
+	sh_lock(SH_STRIPE(l));
+	bool const is_leaf = ! sh_lock_list[l];
+	if (is_leaf) {
+		sh_link(node, l);
+		sh_gen[l] ++;
+	}
+	unsigned gen = sh_gen[l];
+	pthread_mutex_unlock(SH_STRIPE(l));
+
+	if (! is_leaf) {
+		sh_lock(&sh_check_lock);
+		while (1) {
+			if (++sh_epoch == 0) {	// wrapped around
+				memset(sh_tseen, 0, nb_threads * sizeof(*sh_tseen));
+				memset(sh_lseen, 0, nb_locks * sizeof(*sh_lseen));
+				sh_epoch = 1;
+			}
+			sh_nb_scratch = 0;
+			sh_lseen[l] = sh_epoch;
+			bool looping = ! sh_push_threads(l, t);
+			unsigned const nb = sh_nb_scratch;
+			for (unsigned i = 0; i < nb && ! looping; i ++) {
+				looping = sh_is_looping(sh_scratch[i], l, t);
+			}
+			if (looping) {
+#				ifndef NDEBUG
+				printf("thread %u: lock %u would deadlock\n", t, l);
+#				endif
+				pthread_mutex_unlock(&sh_check_lock);
+				sh_lock(&sh_tlocks[t].m);
+				node->in_use = false;
+				pthread_mutex_unlock(&sh_tlocks[t].m);
+				return -1;
+			}
+			sh_lock(SH_STRIPE(l));
+			if (sh_gen[l] == gen) break;	// no leaf added meanwhile, our check still holds
+			gen = sh_gen[l];
+			pthread_mutex_unlock(SH_STRIPE(l));
+		}
+		sh_link(node, l);
+		pthread_mutex_unlock(SH_STRIPE(l));
+		pthread_mutex_unlock(&sh_check_lock);
+	}
+
+#	ifndef NDEBUG
+	printf("thread %u: can safely wait for lock %u\n", t, l);
+#	endif
+	node->count = 1;
+	prim_lock(t, l);
+	return 0;
+}
+
+static void sharded_unlock(unsigned t, unsigned l)
+{
+	struct sh_node *node = NULL;
+	for (unsigned s = 0; s < nb_claimed && ! node; s ++) {
+		struct sh_node *n = sh_slots + t * nb_claimed + s;
+		if (n->count > 0 && n->lock == l) node = n;
+	}
+	assert(node);
+	if (--node->count > 0) {
+		return;
+	}
+
+	sh_lock(&sh_tlocks[t].m);
+	node->in_use = false;
+	pthread_mutex_unlock(&sh_tlocks[t].m);
+
+	sh_lock(SH_STRIPE(l));
+	if (node->prev) node->prev->next = node->next;
+	else sh_lock_list[l] = node->next;
+	if (node->next) node->next->prev = node->prev;
+	pthread_mutex_unlock(SH_STRIPE(l));
+
+	prim_unlock(t, l);
+}
+
+static int sharded_init(void)
+{
+	sh_lock_list = calloc(nb_locks, sizeof(*sh_lock_list));
+	sh_gen = calloc(nb_locks, sizeof(*sh_gen));
+	sh_slots = calloc((size_t)nb_threads * nb_claimed, sizeof(*sh_slots));
+	sh_tlocks = malloc(nb_threads * sizeof(*sh_tlocks));
+	sh_tseen = calloc(nb_threads, sizeof(*sh_tseen));
+	sh_lseen = calloc(nb_locks, sizeof(*sh_lseen));
+	sh_scratch_sz = nb_threads * (nb_claimed + 1);
+	sh_scratch = malloc(sh_scratch_sz * sizeof(*sh_scratch));
+	if (!sh_lock_list || !sh_gen || !sh_slots || !sh_tlocks || !sh_tseen || !sh_lseen || !sh_scratch) return -1;
+
+	for (unsigned i = 0; i < SH_NB_STRIPES; i ++) pthread_mutex_init(&sh_stripes[i].m, NULL);
+	for (unsigned t = 0; t < nb_threads; t ++) {
+		pthread_mutex_init(&sh_tlocks[t].m, NULL);
+		for (unsigned s = 0; s < nb_claimed; s ++) sh_slots[t * nb_claimed + s].thread = t;
+	}
+	sh_epoch = 0;
+	return 0;
+}
+
+static void sharded_fini(void)
+{
+	free(sh_lock_list); sh_lock_list = NULL;
+	free(sh_gen); sh_gen = NULL;
+	free(sh_slots); sh_slots = NULL;
+	free(sh_tlocks); sh_tlocks = NULL;
+	free(sh_tseen); sh_tseen = NULL;
+	free(sh_lseen); sh_lseen = NULL;
+	free(sh_scratch); sh_scratch = NULL;
+}
+
+/*
+ * Timestamp based prevention (as in database lock managers)
+ * Each job is given a timestamp, kept when it's restarted, and conflicts are solved by comparing
+ * the requester's age with the holder's, so that waits only ever go one way:
+ * - wait-die: an older job waits for a younger one, a younger job dies (is rejected) instead;
+ * - wound-wait: an older job wounds a younger holder (which will abort at its next wait), a
+ *   younger job waits for an older one.
+ * Waiting is done by slices of WW_SLICE_NSEC so that decisions are taken again (owners are
+ * recorded once the lock is taken, so may be missing at first).
+ */
+
+#define WW_SLICE_NSEC 100000ULL
+static unsigned *ww_owner;	// per lock, thread holding it or UINT_MAX
+static unsigned *ww_depth;	// per lock, recursion count (only accessed by the owner)
+
+static bool ww_older(unsigned a, unsigned b)
+{
+	uint64_t const ts_a = __atomic_load_n(&thread_ctxs[a].job_ts, __ATOMIC_RELAXED);
+	uint64_t const ts_b = __atomic_load_n(&thread_ctxs[b].job_ts, __ATOMIC_RELAXED);
+	return ts_a < ts_b || (ts_a == ts_b && a < b);
+}
+
+static int ww_lock(unsigned t, unsigned l, bool wound)
+{
+	if (__atomic_load_n(ww_owner+l, __ATOMIC_RELAXED) == t) {
+		ww_depth[l] ++;
+		return 0;
+	}
+
+	int err = prim_trylock(t, l);
+	while (err) {
+		if (__atomic_load_n(&thread_ctxs[t].wounded, __ATOMIC_RELAXED)) {
+#			ifndef NDEBUG
+			printf("thread %u: wounded while waiting for lock %u\n", t, l);
+#			endif
+			return -1;
+		}
+		unsigned const h = __atomic_load_n(ww_owner+l, __ATOMIC_RELAXED);
+		if (h != UINT_MAX) {
+			bool const older = ww_older(t, h);
+			if (wound && older) {
+				__atomic_store_n(&thread_ctxs[h].wounded, true, __ATOMIC_RELAXED);
+			} else if (! wound && ! older) {
+#				ifndef NDEBUG
+				printf("thread %u: dies rather than wait for lock %u held by %u\n", t, l, h);
+#				endif
+				return -1;
+			}
+		}
+		err = prim_timedlock(t, l, now_ns() + WW_SLICE_NSEC);
+	}
+
+	__atomic_store_n(ww_owner+l, t, __ATOMIC_RELAXED);
+	ww_depth[l] = 1;
+	return 0;
+}
+
+static int wait_die_lock(unsigned t, unsigned l)
+{
+	return ww_lock(t, l, false);
+}
+
+static int wound_wait_lock(unsigned t, unsigned l)
+{
+	return ww_lock(t, l, true);
+}
+
+static void ww_unlock(unsigned t, unsigned l)
+{
+	if (--ww_depth[l] > 0) {
+		return;
+	}
+
+	__atomic_store_n(ww_owner+l, UINT_MAX, __ATOMIC_RELAXED);
+	prim_unlock(t, l);
+}
+
+static int ww_init(void)
+{
+	ww_owner = malloc(nb_locks * sizeof(*ww_owner));
+	ww_depth = calloc(nb_locks, sizeof(*ww_depth));
+	if (!ww_owner || !ww_depth) return -1;
+	for (unsigned l = 0; l < nb_locks; l++) ww_owner[l] = UINT_MAX;
+	return 0;
+}
+
+static void ww_fini(void)
+{
+	free(ww_owner); ww_owner = NULL;
+	free(ww_depth); ww_depth = NULL;
+}
+
+/*
+ * Detect (using pthread_timed_lock) rather than prevent
+ */
+
+static int timed_lock(unsigned t, unsigned l)
+{
+	return prim_timedlock(t, l, now_ns() + timeout_nsec);
+}
+
+/*
+ * Same, but adaptive: spin a bit, then wait for a timeout derived from the observed hold time
+ * of that lock, doubling it on each retry. Deadlocks are then detected after a few typical hold
+ * times rather than after a fixed timeout, which is then only used as an upper bound.
+ */
+
+#define AT_NB_SPINS 100
+#define AT_NB_RETRIES 4
+#define AT_MIN_TIMEOUT_NSEC 1000ULL
+static struct at_lock {
+	uint64_t acquired;	// when the lock was taken (only accessed by the owner)
+	uint64_t avg_hold;	// moving average of hold times, in ns (written by the owner only)
+} *at_locks;
+
+static int adaptive_timed_lock(unsigned t, unsigned l)
+{
+	struct at_lock *at = at_locks + l;
+
+	for (unsigned s = 0; s < AT_NB_SPINS; s++) {
+		if (0 == prim_trylock(t, l)) goto got_it;
+		CPU_RELAX();
+	}
+
+	uint64_t const start = now_ns(), deadline = start + timeout_nsec;
+	uint64_t timeout = 2 * __atomic_load_n(&at->avg_hold, __ATOMIC_RELAXED);
+	if (timeout < AT_MIN_TIMEOUT_NSEC) timeout = AT_MIN_TIMEOUT_NSEC;
+	uint64_t until = start;
+	for (unsigned r = 0; r < AT_NB_RETRIES && until < deadline; r++, timeout *= 2) {
+		until += timeout;
+		if (until > deadline) until = deadline;
+		int const err = prim_timedlock(t, l, until);
+		if (0 == err) goto got_it;
+		if (err != ETIMEDOUT) return err;
+	}
+	return ETIMEDOUT;
+
+got_it:
+	at->acquired = now_ns();
+	return 0;
+}
+
+static void adaptive_timed_unlock(unsigned t, unsigned l)
+{
+	struct at_lock *at = at_locks + l;
+	uint64_t const hold = now_ns() - at->acquired;
+	uint64_t const avg = at->avg_hold;
+	__atomic_store_n(&at->avg_hold, avg + ((int64_t)(hold - avg) >> 3), __ATOMIC_RELAXED);
+	prim_unlock(t, l);
+}
+
+static int adaptive_timed_init(void)
+{
+	at_locks = calloc(nb_locks, sizeof(*at_locks));
+	return at_locks ? 0 : -1;
+}
+
+static void adaptive_timed_fini(void)
+{
+	free(at_locks);
+	at_locks = NULL;
+}
+
+/*
+ * Prevent deadlock by forcing ordering of taken locks
+ * This is easy and fast but will cause a *lot* of rejections, though.
+ */
+
+// Held locks are pushed in increasing order so the top of the held set is the highest one
+// Several threads can hold the same lock in shared mode, which does not change the order
+static int ordered_lock_mode(unsigned t, unsigned l, bool shared)
+{
+	struct held_set *hs = HELD_SET(t);
+	struct held_lock *h = held_find(hs, l);
+	if (h) {
+		h->count ++;
+		return 0;
+	}
+
+	if (hs->nb > 0 && hs->held[hs->nb-1].lock > l) {
+#		ifndef NDEBUG
+		printf("thread %u: cannot take lock %u while holding lock %u\n", t, l, hs->held[hs->nb-1].lock);
+#		endif
+		return -1;
+	}
+
+	held_push(hs, l);
+	prim_lock_mode(t, l, shared);
+	return 0;
+}
+
+static int ordered_lock(unsigned t, unsigned l)
+{
+	return ordered_lock_mode(t, l, false);
+}
+
+static int ordered_lock_shared(unsigned t, unsigned l)
+{
+	return ordered_lock_mode(t, l, true);
+}
+
+static void ordered_unlock(unsigned t, unsigned l)
+{
+	if (held_release(HELD_SET(t), l) > 0) {
+		return;
+	}
+
+	prim_unlock(t, l);
+}
+
+// When the whole set is known it's enough to sort it to never be rejected
+struct ordered_claim {
+	unsigned lock;
+	bool shared;
+};
+
+static int cmp_ordered_claim(void const *a_, void const *b_)
+{
+	struct ordered_claim const *a = a_, *b = b_;
+	return a->lock < b->lock ? -1 : a->lock > b->lock;
+}
+
+static int ordered_lock_set(unsigned t, unsigned const *set, bool const *shared, unsigned n)
+{
+	struct ordered_claim sorted[n];
+	for (unsigned i = 0; i < n; i ++) {
+		sorted[i].lock = set[i];
+		sorted[i].shared = shared && shared[i];
+	}
+	qsort(sorted, n, sizeof(*sorted), cmp_ordered_claim);
+	for (unsigned i = 0; i < n; i ++) {
+		if (0 != ordered_lock_mode(t, sorted[i].lock, sorted[i].shared)) {	// can only happen if we already held some locks
+			while (i --) ordered_unlock(t, sorted[i].lock);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int ordered_init(void)
+{
+	return held_init();
+}
+
+/*
+ * Lock order learning (lockdep style)
+ * Locks belong to classes (lock % nb_classes, one class per lock by default), and acquiring a
+ * lock while holding others records an edge from each held class to the target class in a
+ * global order graph, that's kept acyclic: then any wait-for loop would be a loop of classes.
+ * Once an edge is there it's never checked again, so when the held classes are all known
+ * predecessors of the target the lock is taken right away, after one bitmap check against
+ * ld_pred and without any global lock. Only new edges pay for the cycle check, under ld_lock.
+ * As edges are never forgotten, the learned order sticks, and an edge that would close a loop
+ * always will: those are remembered as well, in ld_forbid, so that rejections are quick too.
+ */
+
+static unsigned nb_classes;	// 0 for one class per lock
+static unsigned ld_classes, ld_cells;	// classes and cells per bitmap for the current run
+static uint64_t *ld_pred;	// per class, bitmap of the classes known to be allowed before it
+static uint64_t *ld_forbid;	// per class, bitmap of the classes known to be forbidden before it
+static uint64_t *ld_held;	// per thread, bitmap of the classes it holds (only accessed by the thread itself)
+static size_t ld_held_stride;	// in cells
+static pthread_mutex_t ld_lock = PTHREAD_MUTEX_INITIALIZER;
+// Protected by ld_lock:
+static uint64_t *ld_succ;	// per class, bitmap of its successors
+static uint64_t *ld_seen;	// one bitmap to tag visited classes
+static unsigned *ld_stack;
+static unsigned ld_nb_edges, ld_nb_slow;
+
+#define LD_BIT(c) (1ULL << ((c) % NB_BITS_PER_CELL))
+#define LD_CELL(map, row, c) ((map) + (size_t)(row) * ld_cells + (c) / NB_BITS_PER_CELL)
+
+static unsigned ld_class(unsigned l)
+{
+	return l % ld_classes;
+}
+
+// Can we reach to from from in the order graph?
+static bool ld_reaches(unsigned from, unsigned to)
+{
+	memset(ld_seen, 0, ld_cells * sizeof(*ld_seen));
+	unsigned nb = 0;
+	ld_stack[nb++] = from;
+	ld_seen[from / NB_BITS_PER_CELL] |= LD_BIT(from);
+	while (nb > 0) {
+		unsigned const c = ld_stack[--nb];
+		if (c == to) return true;
+		for (unsigned i = 0; i < ld_cells; i++) {
+			uint64_t next = ld_succ[(size_t)c * ld_cells + i] & ~ld_seen[i];
+			ld_seen[i] |= next;
+			while (next) {
+				unsigned const b = __builtin_ctzll(next);
+				next &= next - 1;
+				ld_stack[nb++] = i * NB_BITS_PER_CELL + b;
+			}
+		}
+	}
+	return false;
+}
+
+// Learn the missing edges from the classes we hold to target, or fail if one would close a loop
+static int ld_learn(uint64_t const *held, unsigned target)
+{
+	if (0 != pthread_mutex_lock(&ld_lock)) {
+		assert(!"Cannot lock ld_lock!?");
+	}
+	ld_nb_slow ++;
+	for (unsigned i = 0; i < ld_cells; i++) {
+		uint64_t missing = held[i] & ~__atomic_load_n(LD_CELL(ld_pred, target, 0) + i, __ATOMIC_RELAXED);
+		while (missing) {
+			unsigned const c = i * NB_BITS_PER_CELL + __builtin_ctzll(missing);
+			missing &= missing - 1;
+			if (c == target || ld_reaches(target, c)) {
+				__atomic_fetch_or(LD_CELL(ld_forbid, target, c), LD_BIT(c), __ATOMIC_RELAXED);
+				pthread_mutex_unlock(&ld_lock);
+				return -1;
+			}
+			*LD_CELL(ld_succ, c, target) |= LD_BIT(target);
+			__atomic_fetch_or(LD_CELL(ld_pred, target, c), LD_BIT(c), __ATOMIC_RELEASE);
+			ld_nb_edges ++;
+		}
+	}
+	pthread_mutex_unlock(&ld_lock);
+	return 0;
+}
+
+static int lockdep_lock(unsigned t, unsigned l)
+{
+	struct held_set *hs = HELD_SET(t);
+	struct held_lock *h = held_find(hs, l);
+	if (h) {
+		h->count ++;
+		return 0;
+	}
+
+	unsigned const c = ld_class(l);
+	uint64_t *held = ld_held + t * ld_held_stride;
+	uint64_t const *pred = LD_CELL(ld_pred, c, 0), *forbid = LD_CELL(ld_forbid, c, 0);
+	bool known = true, forbidden = false;
+	for (unsigned i = 0; i < ld_cells && ! forbidden; i++) {
+		if (! held[i]) continue;
+		if (held[i] & ~__atomic_load_n(pred+i, __ATOMIC_ACQUIRE)) known = false;
+		forbidden = held[i] & __atomic_load_n(forbid+i, __ATOMIC_RELAXED);
+	}
+	if (forbidden || (! known && 0 != ld_learn(held, c))) {
+#		ifndef NDEBUG
+		printf("thread %u: taking lock %u would break the lock order\n", t, l);
+#		endif
+		return -1;
+	}
+
+	held[c / NB_BITS_PER_CELL] |= LD_BIT(c);
+	held_push(hs, l);
+	prim_lock(t, l);
+	return 0;
+}
+
+static void lockdep_unlock(unsigned t, unsigned l)
+{
+	if (held_release(HELD_SET(t), l) > 0) {
+		return;
+	}
+
+	// No other lock of that class can be held, since that would be a loop
+	unsigned const c = ld_class(l);
+	ld_held[t * ld_held_stride + c / NB_BITS_PER_CELL] &= ~LD_BIT(c);
+	prim_unlock(t, l);
+}
+
+static int lockdep_init(void)
+{
+	ld_classes = nb_classes && nb_classes < nb_locks ? nb_classes : nb_locks;
+	ld_cells = upper_multiple_of(ld_classes, NB_BITS_PER_CELL);
+	ld_held_stride = CACHE_LINE / sizeof(*ld_held) * upper_multiple_of(ld_cells * sizeof(*ld_held), CACHE_LINE);
+	ld_pred = calloc((size_t)ld_classes * ld_cells, sizeof(*ld_pred));
+	ld_forbid = calloc((size_t)ld_classes * ld_cells, sizeof(*ld_forbid));
+	ld_succ = calloc((size_t)ld_classes * ld_cells, sizeof(*ld_succ));
+	ld_seen = malloc(ld_cells * sizeof(*ld_seen));
+	ld_stack = malloc(ld_classes * sizeof(*ld_stack));
+	ld_held = rows_alloc(ld_held_stride * sizeof(*ld_held));
+	ld_nb_edges = ld_nb_slow = 0;
+	if (! ld_pred || ! ld_forbid || ! ld_succ || ! ld_seen || ! ld_stack || ! ld_held) return -1;
+	return held_init();
+}
+
+static void lockdep_fini(void)
+{
+	if (verbose) printf("lockdep: %u edges learned between %u classes, %u slow paths\n", ld_nb_edges, ld_classes, ld_nb_slow);
+	free(ld_pred); ld_pred = NULL;
+	free(ld_forbid); ld_forbid = NULL;
+	free(ld_succ); ld_succ = NULL;
+	free(ld_seen); ld_seen = NULL;
+	free(ld_stack); ld_stack = NULL;
+	rows_free(ld_held); ld_held = NULL;
+	held_fini();
+}
+
+/*
+ * Asynchronous lock manager: locks are owned by whoever the manager granted them to, and
+ * requests for a lock that is not free are queued in its FIFO. A request returns as soon as it
+ * is queued and the grant is delivered later by the releaser through a completion word, so
+ * that a whole set is requested at once and granted in any order, the requester only waiting
+ * for the completions (or, as a task, being resumed once they are all in). Deadlocks are
+ * checked before queuing, against the explicit queues: a request waits for the owner and for
+ * the requests ahead of it. The primitive is then taken only by the owner, so never waited for.
+ * Since a whole set is queued at once and queues are served in order, a set only ever waits for
+ * sets requested before it, so only locks taken one by one can be rejected.
+ */
+
+static pthread_mutex_t aq_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Protected by aq_mutex:
+static struct aq_req {
+	struct aq_req *next;	// in the lock queue
+	unsigned thread, lock;
+	unsigned count;	// times this set claims the lock
+	bool queued;
+	uint32_t granted;	// completion, set by the granter
+} *aq_reqs;	// nb_claimed per thread
+static struct aq_lock {
+	unsigned owner;	// or UINT_MAX
+	unsigned count;	// times the owner took it
+	struct aq_req *head, *tail;
+} *aq_locks;
+static unsigned aq_epoch, *aq_seen;	// per thread, epoch of last visit
+static unsigned *aq_stack;	// threads yet to visit
+#define AQ_REQ(t, i) (aq_reqs + (size_t)(t) * nb_claimed + (i))
+
+// Push the owner of l and the threads queued for it before r (NULL for all of them)
+static void aq_push_blockers(unsigned l, struct aq_req const *r, unsigned *nb)
+{
+	unsigned const o = aq_locks[l].owner;
+	if (o != UINT_MAX && aq_seen[o] != aq_epoch) {
+		aq_seen[o] = aq_epoch;
+		aq_stack[(*nb)++] = o;
+	}
+	for (struct aq_req const *q = aq_locks[l].head; q != r; q = q->next) {
+		if (aq_seen[q->thread] == aq_epoch) continue;
+		aq_seen[q->thread] = aq_epoch;
+		aq_stack[(*nb)++] = q->thread;
+	}
+}
+
+// Would t waiting for l close a loop in the wait-for graph?
+static bool aq_is_looping(unsigned t, unsigned l)
+{
+	if (++aq_epoch == 0) {	// wrapped around
+		memset(aq_seen, 0, nb_threads * sizeof(*aq_seen));
+		aq_epoch = 1;
+	}
+	unsigned nb = 0;
+	aq_push_blockers(l, NULL, &nb);
+	while (nb > 0) {
+		unsigned const u = aq_stack[--nb];
+		if (u == t) return true;
+		for (unsigned i = 0; i < nb_claimed; i++) {
+			struct aq_req const *r = AQ_REQ(u, i);
+			if (r->queued) aq_push_blockers(r->lock, r, &nb);
+		}
+	}
+	return false;
+}
+
+// Withdraw the first n requests of t
+static void aq_cancel(unsigned t, unsigned n)
+{
+	for (unsigned i = n; i --; ) {
+		struct aq_req *r = AQ_REQ(t, i);
+		struct aq_lock *lk = aq_locks + r->lock;
+		if (! r->count) continue;	// a duplicate
+		if (! r->queued) {	// granted at once, so nobody is queued yet unless we owned it before
+			assert(lk->owner == t && lk->count >= r->count);
+			if (0 == (lk->count -= r->count)) {
+				assert(lk->head == NULL);
+				lk->owner = UINT_MAX;
+			}
+			continue;
+		}
+		struct aq_req **prev = &lk->head, *last = NULL;
+		while (*prev != r) {
+			last = *prev;
+			prev = &(*prev)->next;
+		}
+		*prev = r->next;
+		if (lk->tail == r) lk->tail = last;
+		r->queued = false;
+	}
+}
+
+static void aq_wait(unsigned t, struct aq_req *r)
+{
+	for (unsigned s = 0; s < SPINS_BEFORE_WAIT && ! nb_workers; s++) {
+		if (__atomic_load_n(&r->granted, __ATOMIC_ACQUIRE)) return;
+		CPU_RELAX();
+	}
+	while (! __atomic_load_n(&r->granted, __ATOMIC_ACQUIRE)) {
+		if (nb_workers) task_yield(t);
+		else futex_wait(&r->granted, 0, 0);
+	}
+}
+
+static int aq_lock_set(unsigned t, unsigned const *set, bool const *shared, unsigned n)
+{
+	(void)shared;
+	if (0 != pthread_mutex_lock(&aq_mutex)) {
+		assert(!"Cannot lock aq_mutex!?");
+	}
+	for (unsigned i = 0; i < n; i++) {
+		unsigned const l = set[i];
+		struct aq_req *r = AQ_REQ(t, i);
+		struct aq_lock *lk = aq_locks + l;
+		r->lock = l;
+		r->count = 0;
+		r->queued = false;
+		r->granted = 1;
+		unsigned j;
+		for (j = 0; j < i && set[j] != l; j++) ;
+		if (j < i) {	// asked again in the same set
+			struct aq_req *first = AQ_REQ(t, j);
+			first->count ++;
+			if (! first->queued) lk->count ++;	// else granted with it
+			continue;
+		}
+		r->count = 1;
+		if (lk->owner == t) {	// from a previous call of the same job
+			lk->count ++;
+			continue;
+		}
+		if (lk->owner == UINT_MAX) {
+			lk->owner = t;
+			lk->count = 1;
+			continue;
+		}
+		if (aq_is_looping(t, l)) {
+#			ifndef NDEBUG
+			printf("thread %u: lock %u would deadlock\n", t, l);
+#			endif
+			aq_cancel(t, i);
+			pthread_mutex_unlock(&aq_mutex);
+			return -1;
+		}
+		r->granted = 0;
+		r->queued = true;
+		r->next = NULL;
+		if (lk->tail) lk->tail->next = r;
+		else lk->head = r;
+		lk->tail = r;
+	}
+	pthread_mutex_unlock(&aq_mutex);
+
+	for (unsigned i = 0; i < n; i++) {
+		struct aq_req *r = AQ_REQ(t, i);
+		if (! r->count) continue;
+		aq_wait(t, r);
+		if (aq_locks[r->lock].count == r->count) prim_lock(t, r->lock);	// first time this job owns it
+	}
+	return 0;
+}
+
+static int aq_lock(unsigned t, unsigned l)
+{
+	return aq_lock_set(t, &l, NULL, 1);
+}
+
+static void aq_unlock(unsigned t, unsigned l)
+{
+	struct aq_req *next = NULL;
+	if (0 != pthread_mutex_lock(&aq_mutex)) {
+		assert(!"Cannot lock aq_mutex!?");
+	}
+	struct aq_lock *lk = aq_locks + l;
+	assert(lk->owner == t);
+	if (0 == -- lk->count) {
+		prim_unlock(t, l);
+		next = lk->head;
+		if (next) {
+			lk->head = next->next;
+			if (! lk->head) lk->tail = NULL;
+			next->queued = false;
+			lk->owner = next->thread;
+			lk->count = next->count;
+			__atomic_store_n(&next->granted, 1, __ATOMIC_RELEASE);
+		} else {
+			lk->owner = UINT_MAX;
+		}
+	}
+	pthread_mutex_unlock(&aq_mutex);
+	if (next && ! nb_workers) futex_wake(&next->granted);
+}
+
+static int aq_init(void)
+{
+	aq_reqs = calloc((size_t)nb_threads * nb_claimed, sizeof(*aq_reqs));
+	aq_locks = malloc(nb_locks * sizeof(*aq_locks));
+	aq_seen = calloc(nb_threads, sizeof(*aq_seen));
+	aq_stack = malloc(nb_threads * sizeof(*aq_stack));
+	if (!aq_reqs || !aq_locks || !aq_seen || !aq_stack) return -1;
+	for (unsigned t = 0; t < nb_threads; t++) {
+		for (unsigned i = 0; i < nb_claimed; i++) AQ_REQ(t, i)->thread = t;
+	}
+	for (unsigned l = 0; l < nb_locks; l++) {
+		aq_locks[l].owner = UINT_MAX;
+		aq_locks[l].count = 0;
+		aq_locks[l].head = aq_locks[l].tail = NULL;
+	}
+	aq_epoch = 0;
+	return 0;
+}
+
+static void aq_fini(void)
+{
+	free(aq_reqs); aq_reqs = NULL;
+	free(aq_locks); aq_locks = NULL;
+	free(aq_seen); aq_seen = NULL;
+	free(aq_stack); aq_stack = NULL;
+}
+
+/*
+ * Optimistic: shared claims are not locked at all but read under a per lock sequence number
+ * (a seqlock), that writers make odd while they hold the lock, and that is validated once the
+ * job is done. A job that read a lock that changed meanwhile is aborted and done again with
+ * all its claims locked as by OrderedLock, which also takes the exclusive claims. A shared claim
+ * on a lock held by a writer is locked right away instead. Optimistic reads hold nothing so
+ * cannot deadlock, and read only jobs that do not conflict skip locking altogether.
+ */
+
+static uint32_t *opt_seqs;	// per lock
+static struct opt_thread {
+	struct opt_read {
+		unsigned lock;
+		uint32_t seq;
+	} *reads;	// nb_claimed, of the current job
+	unsigned nb_reads;
+	unsigned *writes;	// nb_claimed, locks the current job made odd
+	unsigned nb_writes;
+	bool pessimistic;	// redoing an aborted job
+	bool upgraded;	// wrote a lock read before, that had changed meanwhile
+	// Only set by the thread, read once done:
+	uint64_t nb_commits, nb_conflicts, nb_upgrades, nb_busy;
+} __attribute__((aligned(CACHE_LINE))) *opt_threads;
+
+// Returns true if l could be read optimistically
+static bool opt_read(unsigned t, unsigned l)
+{
+	struct opt_thread *o = opt_threads + t;
+	if (o->pessimistic) return false;
+	uint32_t const seq = __atomic_load_n(opt_seqs + l, __ATOMIC_ACQUIRE);
+	if (seq & 1) {
+		o->nb_busy ++;
+		return false;
+	}
+	assert(o->nb_reads < nb_claimed);
+	o->reads[o->nb_reads].lock = l;
+	o->reads[o->nb_reads].seq = seq;
+	o->nb_reads ++;
+	return true;
+}
+
+// Once l is locked for the first time by the job, in exclusive mode
+static void opt_write_begin(unsigned t, unsigned l)
+{
+	struct opt_thread *o = opt_threads + t;
+	uint32_t const seq = __atomic_fetch_add(opt_seqs + l, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);	// odd before the writes
+	for (unsigned i = 0; i < o->nb_reads; i++) {
+		if (o->reads[i].lock != l) continue;
+		if (o->reads[i].seq != seq) o->upgraded = true;
+		o->reads[i].seq = seq + 1;	// then stable until we release it
+	}
+	assert(o->nb_writes < nb_claimed);
+	o->writes[o->nb_writes++] = l;
+}
+
+static int opt_lock_shared(unsigned t, unsigned l)
+{
+	if (opt_read(t, l)) return 0;
+	return ordered_lock_shared(t, l);
+}
+
+static int opt_lock(unsigned t, unsigned l)
+{
+	bool const first = ! held_find(HELD_SET(t), l);
+	if (0 != ordered_lock(t, l)) return -1;
+	if (first) opt_write_begin(t, l);
+	return 0;
+}
+
+static int opt_lock_set(unsigned t, unsigned const *set, bool const *shared, unsigned n)
+{
+	struct opt_thread *o = opt_threads + t;
+	unsigned const nb_reads = o->nb_reads;
+	unsigned locked[n], m = 0;
+	bool locked_shared[n], first[n];
+	for (unsigned i = 0; i < n; i++) {
+		bool const rd = shared && shared[i];
+		if (rd && opt_read(t, set[i])) continue;
+		first[m] = ! rd && ! held_find(HELD_SET(t), set[i]);
+		for (unsigned j = 0; j < m && first[m]; j++) {
+			if (locked[j] == set[i]) first[m] = false;
+		}
+		locked[m] = set[i];
+		locked_shared[m++] = rd;
+	}
+	if (m > 0 && 0 != ordered_lock_set(t, locked, locked_shared, m)) {
+		o->nb_reads = nb_reads;
+		return -1;
+	}
+	for (unsigned i = 0; i < m; i++) {
+		if (first[i]) opt_write_begin(t, locked[i]);
+	}
+	return 0;
+}
+
+static void opt_unlock(unsigned t, unsigned l)
+{
+	struct opt_thread *o = opt_threads + t;
+	for (unsigned i = 0; i < o->nb_reads; i++) {
+		if (o->reads[i].lock != l) continue;
+		o->reads[i] = o->reads[--o->nb_reads];
+		return;
+	}
+	if (held_find(HELD_SET(t), l)->count == 1) {
+		for (unsigned i = 0; i < o->nb_writes; i++) {
+			if (o->writes[i] != l) continue;
+			__atomic_fetch_add(opt_seqs + l, 1, __ATOMIC_RELEASE);
+			o->writes[i] = o->writes[--o->nb_writes];
+			break;
+		}
+	}
+	ordered_unlock(t, l);
+	if (! o->nb_reads && ! HELD_SET(t)->nb) o->upgraded = false;	// in case the job failed
+}
+
+// Once the job is done, before anything is released
+static int opt_validate(unsigned t)
+{
+	struct opt_thread *o = opt_threads + t;
+	if (o->pessimistic) {
+		o->pessimistic = false;
+		return 0;
+	}
+	if (! o->nb_reads) return 0;
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);	// the reads of the job before the check
+	bool conflict = false;
+	for (unsigned i = 0; i < o->nb_reads && ! conflict; i++) {
+		conflict = __atomic_load_n(opt_seqs + o->reads[i].lock, __ATOMIC_RELAXED) != o->reads[i].seq;
+	}
+	if (! conflict && ! o->upgraded) {
+		o->nb_commits ++;
+		return 0;
+	}
+	if (o->upgraded) o->nb_upgrades ++;
+	else o->nb_conflicts ++;
+	o->upgraded = false;
+	o->pessimistic = true;
+	return -1;
+}
+
+static int opt_init(void)
+{
+	opt_seqs = calloc(nb_locks, sizeof(*opt_seqs));
+	if (0 != posix_memalign((void **)&opt_threads, CACHE_LINE, nb_threads * sizeof(*opt_threads))) opt_threads = NULL;
+	if (! opt_seqs || ! opt_threads) return -1;
+	memset(opt_threads, 0, nb_threads * sizeof(*opt_threads));
+	for (unsigned t = 0; t < nb_threads; t++) {
+		opt_threads[t].reads = malloc(nb_claimed * sizeof(*opt_threads[t].reads));
+		opt_threads[t].writes = malloc(nb_claimed * sizeof(*opt_threads[t].writes));
+		if (! opt_threads[t].reads || ! opt_threads[t].writes) return -1;
+	}
+	return held_init();
+}
+
+static void opt_fini(void)
+{
+	uint64_t commits = 0, conflicts = 0, upgrades = 0, busy = 0;
+	if (opt_threads) for (unsigned t = 0; t < nb_threads; t++) {
+		struct opt_thread const *o = opt_threads + t;
+		commits += o->nb_commits;
+		conflicts += o->nb_conflicts;
+		upgrades += o->nb_upgrades;
+		busy += o->nb_busy;
+		free(o->reads);
+		free(o->writes);
+	}
+	uint64_t const tries = commits + conflicts + upgrades;
+	printf("optimistic jobs: %"PRIu64" committed, %"PRIu64" aborted (%.2f%%) of which %"PRIu64" by a concurrent write "
+		"and %"PRIu64" by writing a lock read before; %"PRIu64" shared claims locked as held by a writer\n",
+		commits, conflicts + upgrades, tries ? (100.*(conflicts + upgrades))/tries : 0., conflicts, upgrades, busy);
+	free(opt_seqs); opt_seqs = NULL;
+	free(opt_threads); opt_threads = NULL;
+	held_fini();
+}
+
+/*
+ * Hierarchical: the same forest as Matrix, but first checked between threads and groups of
+ * hg_group_size consecutive locks, as in multi-granularity locking: a thread holds each group
+ * it has rows in with an intention mode, IS if it only has shared rows there and IX otherwise,
+ * and the rows themselves in S or X. Two threads in IS on a group cannot conflict on any of
+ * its rows, so are not connected through it. A path between two threads through rows maps
+ * to a path through their groups, so if the group is not already connected to the requester
+ * the row cannot be either and the request is safe. Only otherwise do we descend to the rows
+ * to tell for sure. Either way the cost depends on the threads and groups visited, and the
+ * state on the number of their claims and groups, not on nb_locks.
+ */
+
+static unsigned hg_group_size = 64;
+static unsigned hg_nb_groups;
+enum hg_mode { HG_IS, HG_IX };
+
+static pthread_mutex_t hg_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Protected by hg_mutex:
+static struct hg_node {	// a thread in a group
+	struct hg_node *prev, *next;	// in the group list
+	unsigned thread, group;
+	unsigned nb_rows, nb_excl;	// rows taken or waited for, and how many exclusively
+} *hg_nodes;	// nb_claimed per thread, unused if ! nb_rows
+static struct hg_row {
+	unsigned lock;
+	unsigned count;
+	bool shared;
+} *hg_rows;	// nb_claimed per thread, the first hg_nb_rows[t] are valid
+static unsigned *hg_nb_rows;
+static struct hg_node **hg_groups;	// list of nodes per group
+static unsigned hg_epoch, *hg_tseen, *hg_gseen, *hg_gseen_x;	// epochs of last visit
+static struct hg_visit {
+	unsigned where;	// group or lock
+	bool weak;	// arrived from an IS (or shared) side
+} *hg_stack;
+static unsigned hg_stack_sz;
+static uint64_t hg_nb_checks, hg_nb_descents, hg_nb_rejects;
+
+#define HG_NODE(t, i) (hg_nodes + (size_t)(t) * nb_claimed + (i))
+#define HG_ROW(t, i) (hg_rows + (size_t)(t) * nb_claimed + (i))
+#define HG_MODE(n) ((n)->nb_excl ? HG_IX : HG_IS)
+
+static struct hg_node *hg_node_find(unsigned t, unsigned g)
+{
+	for (unsigned i = 0; i < nb_claimed; i++) {
+		struct hg_node *n = HG_NODE(t, i);
+		if (n->nb_rows && n->group == g) return n;
+	}
+	return NULL;
+}
+
+static struct hg_row *hg_row_find(unsigned t, unsigned l)
+{
+	for (unsigned i = 0; i < hg_nb_rows[t]; i++) {
+		if (HG_ROW(t, i)->lock == l) return HG_ROW(t, i);
+	}
+	return NULL;
+}
+
+static void hg_new_epoch(void)
+{
+	if (++hg_epoch == 0) {	// wrapped around
+		memset(hg_tseen, 0, nb_threads * sizeof(*hg_tseen));
+		memset(hg_gseen, 0, hg_nb_groups * sizeof(*hg_gseen));
+		memset(hg_gseen_x, 0, hg_nb_groups * sizeof(*hg_gseen_x));
+		hg_epoch = 1;
+	}
+}
+
+static void hg_push(unsigned where, bool weak, unsigned *nb)
+{
+	assert(*nb < hg_stack_sz);
+	hg_stack[*nb].where = where;
+	hg_stack[(*nb)++].weak = weak;
+}
+
+// Is t connected to group g, that it would join in that mode?
+static bool hg_group_reaches(unsigned t, unsigned g, enum hg_mode mode)
+{
+	hg_new_epoch();
+	unsigned nb = 0;
+	hg_push(g, mode == HG_IS, &nb);
+	while (nb > 0) {
+		struct hg_visit const v = hg_stack[--nb];
+		unsigned *seen = v.weak ? hg_gseen : hg_gseen_x;
+		if (seen[v.where] == hg_epoch || hg_gseen_x[v.where] == hg_epoch) continue;
+		seen[v.where] = hg_epoch;
+		for (struct hg_node const *n = hg_groups[v.where]; n; n = n->next) {
+			if (v.weak && HG_MODE(n) == HG_IS) continue;	// cannot conflict
+			if (n->thread == t) return true;
+			if (hg_tseen[n->thread] == hg_epoch) continue;
+			hg_tseen[n->thread] = hg_epoch;
+			for (unsigned i = 0; i < nb_claimed; i++) {
+				struct hg_node const *m = HG_NODE(n->thread, i);
+				// Also come back to this group if we conflict with more of it than we arrived by
+				if (! m->nb_rows || (m == n && ! (v.weak && HG_MODE(m) == HG_IX))) continue;
+				hg_push(m->group, HG_MODE(m) == HG_IS, &nb);
+			}
+		}
+	}
+	return false;
+}
+
+// Is t connected to lock l, that it would take in that mode?
+static bool hg_row_reaches(unsigned t, unsigned l, bool shared)
+{
+	hg_new_epoch();
+	unsigned nb = 0;
+	hg_push(l, shared, &nb);
+	while (nb > 0) {
+		struct hg_visit const v = hg_stack[--nb];
+		for (struct hg_node const *n = hg_groups[v.where / hg_group_size]; n; n = n->next) {
+			struct hg_row const *r = hg_row_find(n->thread, v.where);
+			if (! r) continue;
+			if (v.weak && r->shared) continue;
+			if (n->thread == t) return true;
+			if (hg_tseen[n->thread] == hg_epoch) continue;
+			hg_tseen[n->thread] = hg_epoch;
+			for (unsigned i = 0; i < hg_nb_rows[n->thread]; i++) {
+				struct hg_row const *rr = HG_ROW(n->thread, i);
+				if (rr == r && ! (v.weak && ! rr->shared)) continue;	// same as above
+				hg_push(rr->lock, rr->shared, &nb);
+			}
+		}
+	}
+	return false;
+}
+
+static int hg_lock_mode(unsigned t, unsigned l, bool shared)
+{
+	if (0 != pthread_mutex_lock(&hg_mutex)) {
+		assert(!"Cannot lock hg_mutex!?");
+	}
+	struct hg_row *r = hg_row_find(t, l);
+	if (r) {
+		r->count ++;
+		pthread_mutex_unlock(&hg_mutex);
+		return 0;
+	}
+
+	unsigned const g = l / hg_group_size;
+	struct hg_node *n = hg_node_find(t, g);
+	enum hg_mode const mode = shared && (! n || ! n->nb_excl) ? HG_IS : HG_IX;
+	hg_nb_checks ++;
+	// Already in that group, we could be connected through another of its rows
+	if (n || hg_group_reaches(t, g, mode)) {
+		hg_nb_descents ++;
+		if (hg_row_reaches(t, l, shared)) {
+#			ifndef NDEBUG
+			printf("thread %u: lock %u would deadlock\n", t, l);
+#			endif
+			hg_nb_rejects ++;
+			pthread_mutex_unlock(&hg_mutex);
+			return -1;
+		}
+	}
+
+	assert(hg_nb_rows[t] < nb_claimed);
+	r = HG_ROW(t, hg_nb_rows[t]++);
+	r->lock = l;
+	r->count = 1;
+	r->shared = shared;
+	if (! n) {
+		for (unsigned i = 0; ! n; i++) {
+			assert(i < nb_claimed);
+			if (! HG_NODE(t, i)->nb_rows) n = HG_NODE(t, i);
+		}
+		n->group = g;
+		n->prev = NULL;
+		n->next = hg_groups[g];
+		if (n->next) n->next->prev = n;
+		hg_groups[g] = n;
+	}
+	n->nb_rows ++;
+	if (! shared) n->nb_excl ++;
+	pthread_mutex_unlock(&hg_mutex);
+
+	prim_lock_mode(t, l, shared);
+	return 0;
+}
+
+static int hg_lock(unsigned t, unsigned l)
+{
+	return hg_lock_mode(t, l, false);
+}
+
+static int hg_lock_shared(unsigned t, unsigned l)
+{
+	// Readers are not connected, so they must really share the lock
+	return hg_lock_mode(t, l, prim_shared(t, true));
+}
+
+static void hg_unlock(unsigned t, unsigned l)
+{
+	if (0 != pthread_mutex_lock(&hg_mutex)) {
+		assert(!"Cannot lock hg_mutex!?");
+	}
+	struct hg_row *r = hg_row_find(t, l);
+	assert(r);
+	if (-- r->count > 0) {
+		pthread_mutex_unlock(&hg_mutex);
+		return;
+	}
+	bool const shared = r->shared;
+	*r = *HG_ROW(t, --hg_nb_rows[t]);
+	struct hg_node *n = hg_node_find(t, l / hg_group_size);
+	assert(n);
+	if (! shared) n->nb_excl --;
+	if (0 == -- n->nb_rows) {
+		if (n->prev) n->prev->next = n->next;
+		else hg_groups[n->group] = n->next;
+		if (n->next) n->next->prev = n->prev;
+	}
+	pthread_mutex_unlock(&hg_mutex);
+
+	prim_unlock(t, l);
+}
+
+static int hg_init(void)
+{
+	hg_nb_groups = (nb_locks + hg_group_size - 1) / hg_group_size;
+	hg_nodes = calloc((size_t)nb_threads * nb_claimed, sizeof(*hg_nodes));
+	hg_rows = malloc((size_t)nb_threads * nb_claimed * sizeof(*hg_rows));
+	hg_nb_rows = calloc(nb_threads, sizeof(*hg_nb_rows));
+	hg_groups = calloc(hg_nb_groups, sizeof(*hg_groups));
+	hg_tseen = calloc(nb_threads, sizeof(*hg_tseen));
+	hg_gseen = calloc(hg_nb_groups, sizeof(*hg_gseen));
+	hg_gseen_x = calloc(hg_nb_groups, sizeof(*hg_gseen_x));
+	hg_stack_sz = nb_threads * nb_claimed + 1;
+	hg_stack = malloc(hg_stack_sz * sizeof(*hg_stack));
+	if (!hg_nodes || !hg_rows || !hg_nb_rows || !hg_groups || !hg_tseen || !hg_gseen || !hg_gseen_x || !hg_stack) return -1;
+	for (unsigned t = 0; t < nb_threads; t++) {
+		for (unsigned i = 0; i < nb_claimed; i++) HG_NODE(t, i)->thread = t;
+	}
+	hg_epoch = 0;
+	hg_nb_checks = hg_nb_descents = hg_nb_rejects = 0;
+	return 0;
+}
+
+static void hg_fini(void)
+{
+	if (verbose) {
+		printf("hierarchical: %u groups of %u locks, %"PRIu64" checks, %"PRIu64" descended to the rows, %"PRIu64" rejected\n",
+			hg_nb_groups, hg_group_size, hg_nb_checks, hg_nb_descents, hg_nb_rejects);
+	}
+	free(hg_nodes); hg_nodes = NULL;
+	free(hg_rows); hg_rows = NULL;
+	free(hg_nb_rows); hg_nb_rows = NULL;
+	free(hg_groups); hg_groups = NULL;
+	free(hg_tseen); hg_tseen = NULL;
+	free(hg_gseen); hg_gseen = NULL;
+	free(hg_gseen_x); hg_gseen_x = NULL;
+	free(hg_stack); hg_stack = NULL;
+}
+
+/*
+ * Tests...
+ */
+
+static struct {
+	char const *name;
+	int (*lock)(unsigned, unsigned);
+	void (*unlock)(unsigned, unsigned);
+	int (*init)(void);	// optional, allocates the method private state
+	void (*fini)(void);
+	// optional, takes all the n locks or none of them (and then returns non 0).
+	// Each entry of the set is then released individually. shared is NULL when all claims are exclusive.
+	int (*lock_set)(unsigned, unsigned const *, bool const *, unsigned);
+	int (*lock_shared)(unsigned, unsigned);	// optional, shared claims are otherwise exclusive
+	int (*validate)(unsigned);	// optional, called once the job is done, non 0 to do it again
+} methods[] = {
+	{ "Just take it", just_lock, just_unlock, NULL, NULL, NULL, NULL, NULL },
+	{ "Matrix", matrix_lock, matrix_unlock, matrix_init, matrix_fini, NULL, matrix_lock_shared, NULL },
+	{ "TimedLock", timed_lock, just_unlock, NULL, NULL, NULL, NULL, NULL },
+	{ "OrderedLock", ordered_lock, ordered_unlock, ordered_init, held_fini, ordered_lock_set, ordered_lock_shared, NULL },
+	{ "SparseMatrix", sparse_lock, sparse_unlock, sparse_init, sparse_fini, NULL, NULL, NULL },
+	{ "Incremental", pk_lock, pk_unlock, pk_init, pk_fini, NULL, NULL, NULL },
+	{ "Sharded", sharded_lock, sharded_unlock, sharded_init, sharded_fini, NULL, NULL, NULL },
+	{ "WaitDie", wait_die_lock, ww_unlock, ww_init, ww_fini, NULL, NULL, NULL },
+	{ "WoundWait", wound_wait_lock, ww_unlock, ww_init, ww_fini, NULL, NULL, NULL },
+	{ "AdaptiveTimed", adaptive_timed_lock, adaptive_timed_unlock, adaptive_timed_init, adaptive_timed_fini, NULL, NULL, NULL },
+	{ "Lockdep", lockdep_lock, lockdep_unlock, lockdep_init, lockdep_fini, NULL, NULL, NULL },
+	{ "AsyncQueue", aq_lock, aq_unlock, aq_init, aq_fini, aq_lock_set, NULL, NULL },
+	{ "Optimistic", opt_lock, opt_unlock, opt_init, opt_fini, opt_lock_set, opt_lock_shared, opt_validate },
+	{ "Hierarchical", hg_lock, hg_unlock, hg_init, hg_fini, NULL, hg_lock_shared, NULL },
+	// Registering the whole set up front makes the graph denser, so this rejects more than Matrix
+	{ "MatrixSet", matrix_lock, matrix_unlock, matrix_init, matrix_fini, matrix_lock_set, matrix_lock_shared, NULL },
+};
+
+/*
+ * Per thread PRNG (xoshiro256**), since rand() serializes all threads on libc's lock
+ */
+
+static uint64_t splitmix64(uint64_t *x)
+{
+	uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+static void rand_init(struct thread_ctx *ctx, unsigned t)
+{
+	uint64_t x = seed + t * 0x100000001b3ULL;
+	for (unsigned i = 0; i < NB_ELEMS(ctx->rand_state); i++) {
+		ctx->rand_state[i] = splitmix64(&x);
+	}
+}
+
+static uint64_t rotl(uint64_t x, int k)
+{
+	return (x << k) | (x >> (64 - k));
+}
+
+static uint64_t rand_next(struct thread_ctx *ctx)
+{
+	uint64_t *s = ctx->rand_state;
+	uint64_t const res = rotl(s[1] * 5, 7) * 9;
+	uint64_t const t = s[1] << 17;
+	s[2] ^= s[0];
+	s[3] ^= s[1];
+	s[1] ^= s[2];
+	s[0] ^= s[3];
+	s[2] ^= t;
+	s[3] = rotl(s[3], 45);
+	return res;
+}
+
+// uniform in [0, n[ (0 if n is 0)
+static unsigned rand_below(struct thread_ctx *ctx, unsigned n)
+{
+	return ((rand_next(ctx) >> 32) * n) >> 32;
+}
+
+/*
+ * What to do with a failed job: start a new one (none), or retry it after some backoff
+ */
+
+enum retry_policy { RETRY_NONE, RETRY_EXP, RETRY_JITTER, RETRY_YIELD };
+static char const *retry_names[] = { "none", "exp", "jitter", "yield" };
+static bool use_lock_set = true;	// when the method has one
+static double shared_ratio;	// share of the claims that are shared
+static uint64_t shared_threshold;	// a claim is shared when the 32 random bits are below this
+static enum retry_policy retry_policy = RETRY_NONE;
+static unsigned max_retries = 100;	// before giving up a job
+#define RETRY_MIN_USEC 1
+#define RETRY_MAX_USEC 1000
+
+/*
+ * Lock selection: which locks the jobs claim. Skewed distributions are sampled with an alias
+ * table (Vose) built before each run, so that a draw takes two random numbers and no float.
+ * For zipf and hotspot the lowest numbered locks are the hottest.
+ */
+
+enum distribution { DIST_UNIFORM, DIST_ZIPF, DIST_HOTSPOT, DIST_AFFINE };
+static char const *dist_names[] = { "uniform", "zipf", "hotspot", "affine" };
+static enum distribution distribution = DIST_UNIFORM;
+static double dist_params[2];	// theta for zipf, share of accesses and share of locks for hotspot, local ratio for affine
+static char dist_desc[64] = "uniform";
+
+static struct alias {
+	uint32_t prob;	// keep the column with probability prob/2^32, or else take alias (which is the column itself when prob is 1)
+	unsigned alias;
+} *alias_table;	// nb_locks entries
+static uint64_t local_threshold;	// affine: a claim is local when the 32 random bits are below this
+
+static int alias_build(double const *w)
+{
+	alias_table = malloc(nb_locks * sizeof(*alias_table));
+	double *p = malloc(nb_locks * sizeof(*p));
+	unsigned *small = malloc(nb_locks * sizeof(*small)), *large = malloc(nb_locks * sizeof(*large));
+	if (! alias_table || ! p || ! small || ! large) {
+		free(p); free(small); free(large);
+		return -1;
+	}
+
+	double sum = 0.;
+	for (unsigned l = 0; l < nb_locks; l++) sum += w[l];
+	unsigned nb_small = 0, nb_large = 0;
+	for (unsigned l = 0; l < nb_locks; l++) {
+		p[l] = w[l] * nb_locks / sum;
+		if (p[l] < 1.) small[nb_small++] = l;
+		else large[nb_large++] = l;
+	}
+	while (nb_small > 0 && nb_large > 0) {
+		unsigned const s = small[--nb_small], g = large[nb_large-1];
+		alias_table[s].prob = p[s] * 4294967296.;
+		alias_table[s].alias = g;
+		p[g] -= 1. - p[s];
+		if (p[g] < 1.) {
+			nb_large --;
+			small[nb_small++] = g;
+		}
+	}
+	// What's left is 1 but for rounding errors
+	while (nb_large > 0) {
+		unsigned const g = large[--nb_large];
+		alias_table[g].prob = UINT32_MAX;
+		alias_table[g].alias = g;
+	}
+	while (nb_small > 0) {
+		unsigned const s = small[--nb_small];
+		alias_table[s].prob = UINT32_MAX;
+		alias_table[s].alias = s;
+	}
+
+	free(p); free(small); free(large);
+	return 0;
+}
+
+static int dist_init(void)
+{
+	if (distribution == DIST_AFFINE) {
+		local_threshold = dist_params[0] * 4294967296.;
+		return 0;
+	}
+	if (distribution == DIST_UNIFORM) return 0;
+
+	double *w = malloc(nb_locks * sizeof(*w));
+	if (! w) return -1;
+	if (distribution == DIST_ZIPF) {
+		for (unsigned l = 0; l < nb_locks; l++) w[l] = 1. / pow(l + 1, dist_params[0]);
+	} else {
+		unsigned nb_hot = ceil(dist_params[1] * nb_locks);
+		if (nb_hot == 0) nb_hot = 1;
+		for (unsigned l = 0; l < nb_locks; l++) {
+			w[l] = l < nb_hot ? dist_params[0] / nb_hot :
+				nb_hot < nb_locks ? (1. - dist_params[0]) / (nb_locks - nb_hot) : 0.;
+		}
+	}
+	int const err = alias_build(w);
+	free(w);
+	return err;
+}
+
+static void dist_fini(void)
+{
+	free(alias_table);
+	alias_table = NULL;
+}
+
+// Affine threads prefer their own partition of the locks
+static unsigned pick_lock(struct thread_ctx *ctx, unsigned t)
+{
+	switch (distribution) {
+		case DIST_UNIFORM:
+			break;
+		case DIST_ZIPF:
+		case DIST_HOTSPOT:
+			{
+				struct alias const *a = alias_table + rand_below(ctx, nb_locks);
+				return (rand_next(ctx) >> 32) < a->prob ? (unsigned)(a - alias_table) : a->alias;
+			}
+		case DIST_AFFINE:
+			if ((rand_next(ctx) >> 32) < local_threshold) {
+				unsigned const first = (uint64_t)t * nb_locks / nb_threads;
+				unsigned const last = (uint64_t)(t+1) * nb_locks / nb_threads;
+				return first + (last > first ? rand_below(ctx, last - first) : 0);
+			}
+			break;
+	}
+	return rand_below(ctx, nb_locks);
+}
+
+// Parse "name[:param[:param]]", with default parameters. Returns -1 on error.
+static int parse_distribution(char const *str)
+{
+	static double const defaults[][2] = {
+		[DIST_UNIFORM] = { 0., 0. },
+		[DIST_ZIPF] = { .99, 0. },
+		[DIST_HOTSPOT] = { .9, .1 },
+		[DIST_AFFINE] = { .9, 0. },
+	};
+	static unsigned const nb_params[] = { [DIST_UNIFORM] = 0, [DIST_ZIPF] = 1, [DIST_HOTSPOT] = 2, [DIST_AFFINE] = 1 };
+	size_t const len = strcspn(str, ":");
+	unsigned d;
+	for (d = 0; d < NB_ELEMS(dist_names); d++) {
+		if (strlen(dist_names[d]) == len && 0 == strncmp(str, dist_names[d], len)) break;
+	}
+	if (d >= NB_ELEMS(dist_names)) return -1;
+	distribution = d;
+	memcpy(dist_params, defaults[d], sizeof(dist_params));
+	str += len;
+	for (unsigned p = 0; *str == ':'; p++) {
+		char *end;
+		if (p >= nb_params[d]) return -1;
+		dist_params[p] = strtod(str+1, &end);
+		if (end == str+1) return -1;
+		str = end;
+	}
+	if (*str != '\0') return -1;
+	if (d == DIST_ZIPF && !(dist_params[0] >= 0.)) return -1;
+	if (d != DIST_ZIPF) {
+		for (unsigned p = 0; p < nb_params[d]; p++) {
+			if (!(dist_params[p] >= 0. && dist_params[p] <= 1.)) return -1;
+		}
+	}
+
+	int n = snprintf(dist_desc, sizeof(dist_desc), "%s", dist_names[d]);
+	for (unsigned p = 0; p < nb_params[d]; p++) {
+		n += snprintf(dist_desc + n, sizeof(dist_desc) - n, ":%g", dist_params[p]);
+	}
+	return 0;
+}
 
 /*
- * Just take it method : will quickly leads to deadlock
+ * Job models: what a job does with its locks, up to job_size units. Sleeping parks the thread
+ * in the kernel and cannot go much below 50us, so for short critical sections the job can also
+ * spin for some nanoseconds (with a loop calibrated at startup), or touch job_size cache lines
+ * of the payload of each of its locks (only reading those of its shared claims).
  */
 
-static int just_lock(unsigned t, unsigned l)
+enum job_model { JOB_SLEEP, JOB_SPIN, JOB_TOUCH };
+static char const *job_model_names[] = { "sleep", "spin", "touch" };
+static char const *job_model_units[] = { "usecs", "nsecs", "lines" };
+static enum job_model job_model = JOB_SLEEP;
+static uint64_t spin_per_1024ns;	// iterations of spin_loop per 1024ns
+static uint64_t *payload;	// job_size cache lines per lock
+#define PAYLOAD_LINE(l, i) (payload + ((size_t)(l) * job_size + (i)) * (CACHE_LINE / sizeof(*payload)))
+
+static void spin_loop(uint64_t n)
+{
+	for (uint64_t i = 0; i < n; i++) __asm__ __volatile__("" ::: "memory");
+}
+
+static void spin_calibrate(void)
+{
+	uint64_t n = 1024, elapsed;
+	do {
+		n *= 2;
+		uint64_t const start = now_ns();
+		spin_loop(n);
+		elapsed = now_ns() - start;
+	} while (elapsed < 10000000ULL);	// 10ms
+	spin_per_1024ns = n * 1024 / elapsed;
+	printf("Spin loop: %.3f iterations per ns\n", spin_per_1024ns / 1024.);
+}
+
+static int payload_init(void)
+{
+	if (job_model != JOB_TOUCH || job_size == 0) return 0;
+	size_t const size = (size_t)nb_locks * job_size * CACHE_LINE;
+	if (0 != posix_memalign((void **)&payload, CACHE_LINE, size)) {
+		payload = NULL;
+		return -1;
+	}
+	memset(payload, 0, size);
+	return 0;
+}
+
+static void payload_fini(void)
+{
+	free(payload);
+	payload = NULL;
+}
+
+static void do_job(struct thread_ctx *ctx, unsigned const *claims, bool const *shared)
+{
+	switch (job_model) {
+		case JOB_SLEEP:
+			task_usleep(ctx - thread_ctxs, rand_below(ctx, job_size));
+			break;
+		case JOB_SPIN:
+			spin_loop((rand_below(ctx, job_size) * spin_per_1024ns) >> 10);
+			break;
+		case JOB_TOUCH:
+			{
+				uint64_t sum = 0;
+				for (unsigned c = 0; c < nb_claimed; c++) {
+					for (unsigned i = 0; i < job_size; i++) {
+						uint64_t *line = PAYLOAD_LINE(claims[c], i);
+						if (shared[c]) sum += *(uint64_t volatile *)line;
+						else (*(uint64_t volatile *)line) ++;
+					}
+				}
+				(void)sum;
+			}
+			break;
+	}
+}
+
+/*
+ * Tracing: each thread records its events in its own ring buffer, which is only ever written by
+ * that thread, and the rings are dumped into a file (through mmap) after each run. At the start
+ * of each job the whole claim set is recorded, so that it can be replayed later: in replay mode
+ * each thread runs again the jobs recorded for the same thread, in the same order, with
+ * whatever method and primitive, then stops. Timestamps are CLOCK_MONOTONIC nanoseconds.
+ */
+
+enum trace_type { EV_JOB, EV_CLAIM, EV_TRY, EV_ACQUIRED, EV_REJECTED, EV_RELEASED };
+
+struct trace_event {
+	uint64_t ts;
+	uint32_t lock;
+	uint16_t thread;
+	uint8_t type;	// enum trace_type
+	uint8_t shared;	// for claims and tries
+};
+
+#define TRACE_MAGIC "LATRACE1"
+struct trace_header {
+	char magic[8];
+	uint32_t nb_threads, nb_locks, nb_claimed, method, primitive, pad;
+	uint64_t start;	// date of the run start
+	uint64_t nb_events;	// following this header and sorted by thread
+};
+
+static char const *trace_path;
+static unsigned trace_size = 16384;	// events per thread, a power of 2
+static uint64_t trace_mask;
+static unsigned trace_nb_runs;	// to name the files after the first one
+static struct trace_event *trace_events;	// the rings of all threads
+
+// Replayed jobs, nb_claimed claims each, in replay_first[t]..replay_first[t+1] for thread t
+static unsigned replay_nb_threads;	// 0 when not replaying
+static unsigned *replay_first;
+static uint32_t *replay_locks;
+static bool *replay_shared;
+
+static void trace_add(struct thread_ctx *ctx, unsigned t, enum trace_type type, unsigned lock, bool shared)
+{
+	if (! ctx->trace) return;
+	struct trace_event *e = ctx->trace + (ctx->trace_head++ & trace_mask);
+	e->ts = now_ns();
+	e->lock = lock;
+	e->thread = t;
+	e->type = type;
+	e->shared = shared;
+}
+
+static int trace_init(void)
+{
+	if (! trace_path) return 0;
+	if (nb_threads > UINT16_MAX + 1U) {
+		fprintf(stderr, "Cannot trace more than %u threads\n", UINT16_MAX + 1U);
+		return -1;
+	}
+	trace_mask = trace_size - 1;
+	trace_events = malloc((size_t)nb_threads * trace_size * sizeof(*trace_events));
+	if (! trace_events) {
+		fprintf(stderr, "Cannot alloc.\n");
+		return -1;
+	}
+	for (unsigned t = 0; t < nb_threads; t++) thread_ctxs[t].trace = trace_events + (size_t)t * trace_size;
+	return 0;
+}
+
+// Only the most recent events of each thread are left in the rings
+static void trace_dump(uint64_t start)
+{
+	if (! trace_path) return;
+
+	uint64_t nb_events = 0;
+	for (unsigned t = 0; t < nb_threads; t++) {
+		uint64_t const head = thread_ctxs[t].trace_head;
+		nb_events += head < trace_size ? head : trace_size;
+	}
+	size_t const size = sizeof(struct trace_header) + nb_events * sizeof(struct trace_event);
+
+	char path[PATH_MAX];
+	if (trace_nb_runs == 0) snprintf(path, sizeof(path), "%s", trace_path);
+	else snprintf(path, sizeof(path), "%s.%u", trace_path, trace_nb_runs);
+	trace_nb_runs ++;
+	int const fd = open(path, O_RDWR|O_CREAT|O_TRUNC, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "Cannot open %s: %s\n", path, strerror(errno));
+		return;
+	}
+	char *map = MAP_FAILED;
+	if (0 == ftruncate(fd, size)) map = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "Cannot write %s: %s\n", path, strerror(errno));
+		close(fd);
+		return;
+	}
+
+	struct trace_header *h = (struct trace_header *)map;
+	memset(h, 0, sizeof(*h));
+	memcpy(h->magic, TRACE_MAGIC, sizeof(h->magic));
+	h->nb_threads = nb_threads;
+	h->nb_locks = nb_locks;
+	h->nb_claimed = nb_claimed;
+	h->method = method;
+	h->primitive = primitive;
+	h->start = start;
+	h->nb_events = nb_events;
+	struct trace_event *e = (struct trace_event *)(h + 1);
+	for (unsigned t = 0; t < nb_threads; t++) {
+		struct thread_ctx const *ctx = thread_ctxs + t;
+		uint64_t const head = ctx->trace_head;
+		for (uint64_t i = head < trace_size ? 0 : head - trace_size; i < head; i++) {
+			*e++ = ctx->trace[i & trace_mask];
+		}
+	}
+	munmap(map, size);
+	close(fd);
+	printf("%"PRIu64" events written in %s\n", nb_events, path);
+}
+
+static void trace_fini(void)
+{
+	free(trace_events);
+	trace_events = NULL;
+}
+
+// Load the jobs to replay, and the run parameters, from a trace file. Returns -1 on error.
+static int replay_load(char const *path)
+{
+	int const fd = open(path, O_RDONLY);
+	struct stat st;
+	if (fd < 0 || 0 != fstat(fd, &st)) {
+		fprintf(stderr, "Cannot open %s: %s\n", path, strerror(errno));
+		if (fd >= 0) close(fd);
+		return -1;
+	}
+	void *map = (size_t)st.st_size < sizeof(struct trace_header) ? MAP_FAILED :
+		mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	struct trace_header const *h = map;
+	if (map == MAP_FAILED || 0 != memcmp(h->magic, TRACE_MAGIC, sizeof(h->magic)) ||
+		h->nb_threads == 0 || h->nb_locks == 0 || h->nb_claimed == 0 ||
+		(size_t)st.st_size != sizeof(*h) + h->nb_events * sizeof(struct trace_event)) {
+		fprintf(stderr, "Invalid trace file %s\n", path);
+		if (map != MAP_FAILED) munmap(map, st.st_size);
+		return -1;
+	}
+
+	replay_nb_threads = nb_threads = h->nb_threads;
+	nb_locks = h->nb_locks;
+	nb_claimed = h->nb_claimed;
+	struct trace_event const *events = (struct trace_event const *)(h + 1);
+	// At most one job per JOB event. Jobs are indexed per thread, so events must be sorted by thread.
+	uint64_t nb_jobs = 0;
+	for (uint64_t i = 0; i < h->nb_events; i++) {
+		if (i > 0 && events[i].thread < events[i-1].thread) {
+			fprintf(stderr, "Invalid trace file %s: events are not sorted by thread\n", path);
+			munmap(map, st.st_size);
+			return -1;
+		}
+		nb_jobs += events[i].type == EV_JOB;
+	}
+	if (nb_jobs == 0) {
+		fprintf(stderr, "No job to replay in %s\n", path);
+		munmap(map, st.st_size);
+		return -1;
+	}
+	replay_first = calloc(nb_threads + 1, sizeof(*replay_first));
+	replay_locks = malloc(nb_jobs * nb_claimed * sizeof(*replay_locks));
+	replay_shared = malloc(nb_jobs * nb_claimed * sizeof(*replay_shared));
+	if (! replay_first || ! replay_locks || ! replay_shared) {
+		fprintf(stderr, "Cannot alloc.\n");
+		munmap(map, st.st_size);
+		return -1;
+	}
+
+	// A job is a JOB event followed by nb_claimed CLAIM events of the same thread
+	unsigned nb = 0;
+	for (uint64_t i = 0; i < h->nb_events; i++) {
+		struct trace_event const *e = events + i;
+		if (e->type != EV_JOB || e->thread >= nb_threads || i + nb_claimed >= h->nb_events) continue;
+		unsigned c;
+		for (c = 0; c < nb_claimed; c++) {
+			struct trace_event const *claim = e + 1 + c;
+			if (claim->type != EV_CLAIM || claim->thread != e->thread || claim->lock >= nb_locks) break;
+			replay_locks[nb * nb_claimed + c] = claim->lock;
+			replay_shared[nb * nb_claimed + c] = claim->shared;
+		}
+		if (c < nb_claimed) continue;	// truncated by the ring
+		replay_first[e->thread + 1] = ++nb;
+	}
+	for (unsigned t = 1; t <= nb_threads; t++) {	// also for threads without any job
+		if (replay_first[t] < replay_first[t-1]) replay_first[t] = replay_first[t-1];
+	}
+	munmap(map, st.st_size);
+	printf("Replaying %u jobs of %u threads from %s\n", nb, nb_threads, path);
+	return 0;
+}
+
+/*
+ * Performance counters: with -P each worker opens a group of counters that is enabled only
+ * during the calls to the method (lock, lock_set and unlock), so that its cost can be told
+ * apart from the job. Counters the kernel or the hardware refuses are just left out, and
+ * kernel time is only counted if allowed, leaving out the events that only happen there.
+ * Counters the PMU had to multiplex are scaled, and those it never scheduled left out too.
+ * This adds two syscalls per call, inflating the latencies accordingly.
+ */
+
+static bool perf_enabled;
+static struct perf_counter {
+	char const *name;
+	uint32_t type;
+	uint64_t config;
+	bool kernel_only;	// always 0 if kernel time is excluded
+} const perf_counters[NB_PERF_COUNTERS] = {
+	{ "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, false },
+	{ "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, false },
+	{ "llc_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, false },
+	// There is no portable event for cache line transfers, L1D misses are the closest
+	{ "l1d_misses", PERF_TYPE_HW_CACHE,
+		PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16), false },
+	{ "ctx_switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES, true },
+};
+static bool perf_ok[NB_PERF_COUNTERS];	// as probed at startup
+static bool perf_user_only[NB_PERF_COUNTERS];
+
+static int perf_open_counter(unsigned c, int group)
+{
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = perf_counters[c].type;
+	attr.config = perf_counters[c].config;
+	attr.disabled = group < 0;	// members follow the leader
+	attr.exclude_hv = 1;
+	attr.exclude_kernel = perf_user_only[c];
+	attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+	return syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+static void perf_probe(void)
+{
+	unsigned nb_ok = 0;
+	for (unsigned c = 0; c < NB_PERF_COUNTERS; c++) {
+		int fd = perf_open_counter(c, -1);
+		if (fd < 0 && (errno == EACCES || errno == EPERM)) {
+			perf_user_only[c] = true;
+			fd = perf_open_counter(c, -1);
+		}
+		perf_ok[c] = fd >= 0 && ! (perf_user_only[c] && perf_counters[c].kernel_only);
+		if (fd >= 0) close(fd);
+		if (perf_ok[c]) {
+			nb_ok ++;
+		} else if (verbose) {
+			printf("perf: no %s counter: %s\n", perf_counters[c].name,
+				fd >= 0 ? "only counted in the kernel, which is not allowed" : strerror(errno));
+		}
+	}
+	if (nb_ok == 0) {
+		fprintf(stderr, "No performance counter available, ignoring -P\n");
+		perf_enabled = false;
+	}
+}
+
+static void perf_open(struct thread_ctx *ctx)
+{
+	ctx->perf_leader = -1;
+	for (unsigned c = 0; c < NB_PERF_COUNTERS; c++) {
+		ctx->perf_fds[c] = perf_enabled && perf_ok[c] ? perf_open_counter(c, ctx->perf_leader) : -1;
+		if (ctx->perf_leader < 0) ctx->perf_leader = ctx->perf_fds[c];
+	}
+}
+
+static void perf_start(struct thread_ctx *ctx)
+{
+	if (ctx->perf_leader < 0) return;
+	ioctl(ctx->perf_leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+}
+
+static void perf_stop(struct thread_ctx *ctx)
+{
+	if (ctx->perf_leader < 0) return;
+	ioctl(ctx->perf_leader, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+	ctx->perf_calls ++;
+}
+
+static void perf_close(struct thread_ctx *ctx)
+{
+	for (unsigned c = 0; c < NB_PERF_COUNTERS; c++) {
+		if (ctx->perf_fds[c] < 0) continue;
+		struct { uint64_t value, enabled, running; } v;
+		ctx->perf_counts[c] = -1;
+		if (sizeof(v) == read(ctx->perf_fds[c], &v, sizeof(v))) {
+			if (v.running >= v.enabled) ctx->perf_counts[c] = v.value;	// including never enabled
+			else if (v.running > 0) ctx->perf_counts[c] = (double)v.value * v.enabled / v.running;
+		}
+		close(ctx->perf_fds[c]);
+	}
+}
+
+/*
+ * Per lock profile: with -p each lock has its own counters, in a padded array parallel to
+ * locks so that threads updating different locks do not share cache lines. Waits are the time
+ * spent in the method lock function, holds the time from acquisition to release. When the
+ * whole set is taken at once the method does not tell which lock failed, so the wait and
+ * the rejection are accounted to every lock of the set.
+ */
+
+static unsigned profile_top;	// 0 to disable profiling
+static FILE *profile_file;	// full dump, or NULL
+static unsigned profile_run;	// index of the run in the dump
+
+static struct lock_stat {
+	uint64_t acquired, rejected;
+	uint64_t wait_total, wait_max;	// in nanoseconds
+	uint64_t hold_total;
+} __attribute__((aligned(CACHE_LINE))) *lock_stats;
+
+static void profile_wait(unsigned lock, uint64_t wait, bool acquired)
+{
+	struct lock_stat *s = lock_stats + lock;
+	__atomic_fetch_add(acquired ? &s->acquired : &s->rejected, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&s->wait_total, wait, __ATOMIC_RELAXED);
+	uint64_t max = __atomic_load_n(&s->wait_max, __ATOMIC_RELAXED);
+	while (wait > max && !__atomic_compare_exchange_n(&s->wait_max, &max, wait, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) ;
+}
+
+static void profile_hold(unsigned lock, uint64_t hold)
+{
+	__atomic_fetch_add(&lock_stats[lock].hold_total, hold, __ATOMIC_RELAXED);
+}
+
+static int profile_open(char const *path)
+{
+	profile_file = 0 == strcmp(path, "-") ? stdout : fopen(path, "w");
+	if (! profile_file) {
+		fprintf(stderr, "Cannot open %s\n", path);
+		return -1;
+	}
+	fprintf(profile_file, "run,method,primitive,threads,locks,claims,lock,acquired,rejected,wait_total,wait_max,hold_total\n");
+	return 0;
+}
+
+// Most rejected first, then most waited for
+static int cmp_lock_stat(void const *a_, void const *b_)
+{
+	struct lock_stat const *a = lock_stats + *(unsigned const *)a_, *b = lock_stats + *(unsigned const *)b_;
+	if (a->rejected != b->rejected) return a->rejected > b->rejected ? -1 : 1;
+	if (a->wait_total != b->wait_total) return a->wait_total > b->wait_total ? -1 : 1;
+	return 0;
+}
+
+// Must be called once all threads are done
+static void profile_report(void)
+{
+	if (! profile_top) return;
+	profile_run ++;
+	if (profile_file) {
+		for (unsigned m = 0; m < nb_locks; m++) {
+			struct lock_stat const *s = lock_stats + m;
+			fprintf(profile_file, "%u,\"%s\",\"%s\",%u,%u,%u,%u,%"PRIu64",%"PRIu64",%"PRIu64",%"PRIu64",%"PRIu64"\n",
+				profile_run, methods[method].name, primitives[primitive].name, nb_threads, nb_locks, nb_claimed,
+				m, s->acquired, s->rejected, s->wait_total, s->wait_max, s->hold_total);
+		}
+		fflush(profile_file);
+	}
+	unsigned *order = malloc(nb_locks * sizeof(*order));
+	if (! order) {
+		fprintf(stderr, "Cannot alloc.\n");
+		return;
+	}
+	for (unsigned m = 0; m < nb_locks; m++) order[m] = m;
+	qsort(order, nb_locks, sizeof(*order), cmp_lock_stat);
+	printf("%-8s %12s %12s %8s %12s %12s %12s\n", "lock", "acquired", "rejected", "rej%", "wait avg", "wait max", "hold avg");
+	for (unsigned r = 0; r < profile_top && r < nb_locks; r++) {
+		struct lock_stat const *s = lock_stats + order[r];
+		uint64_t const trys = s->acquired + s->rejected;
+		printf("%-8u %12"PRIu64" %12"PRIu64" %7.2f%% %12.0f %12"PRIu64" %12.0f\n",
+			order[r], s->acquired, s->rejected, trys ? (100.*s->rejected)/trys : 0.,
+			trys ? (double)s->wait_total / trys : 0., s->wait_max,
+			s->acquired ? (double)s->hold_total / s->acquired : 0.);
+	}
+	free(order);
+}
+
+static void backoff(struct thread_ctx *ctx, unsigned retry)
+{
+	unsigned const t = ctx - thread_ctxs;
+	unsigned usec = RETRY_MAX_USEC;
+	if (retry < 31 && (RETRY_MIN_USEC << retry) < RETRY_MAX_USEC) usec = RETRY_MIN_USEC << retry;
+
+	switch (retry_policy) {
+		case RETRY_NONE:
+			break;
+		case RETRY_EXP:
+			task_usleep(t, usec);
+			break;
+		case RETRY_JITTER:
+			task_usleep(t, rand_below(ctx, usec + 1));
+			break;
+		case RETRY_YIELD:
+			task_yield(t);
+			break;
+	}
+}
+
+/*
+ * A run goes through a warm-up, during which the workers run but are not measured, then the
+ * measurement, then the drain, during which they finish their current job and exit. Jobs are
+ * accounted to the phase they started in, which all threads enter at the same time thanks to
+ * the start gate.
+ */
+
+enum run_phase { PHASE_WARMUP, PHASE_MEASURE, PHASE_DRAIN };
+static int phase;	// only written by the main thread
+static unsigned warmup_msec = 0;
+static unsigned drain_msec = 10000;	// threads still running after that long are given up (0 to wait forever)
+static pthread_mutex_t run_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t run_cond;	// signaled when a thread exits or a deadlock is detected (uses CLOCK_MONOTONIC)
+static unsigned nb_running;	// protected by run_lock
+static unsigned run_gen;	// bumped when giving up on a run (only written by the main thread)
+static unsigned nb_starting;	// threads (or workers) and main thread yet to reach the start, protected by run_lock
+
+// Start gate: wait for all the others, counting only the threads that could be created
+static void run_wait_start(void)
+{
+	pthread_mutex_lock(&run_lock);
+	if (-- nb_starting == 0) pthread_cond_broadcast(&run_cond);
+	while (nb_starting > 0) pthread_cond_wait(&run_cond, &run_lock);
+	pthread_mutex_unlock(&run_lock);
+}
+
+/* Whether the main thread gave up on the run of that thread, and may be running the next one
+ * with other method state: the thread must then leave everything alone and exit. */
+static bool given_up(struct thread_ctx const *ctx)
+{
+	return __atomic_load_n(&run_gen, __ATOMIC_ACQUIRE) != ctx->gen;
+}
+
+static void *thread_run(void *idx)
+{
+	unsigned const t = (unsigned)(intptr_t)idx;
+	struct thread_ctx *ctx = thread_ctxs + t;
+	rand_init(ctx, t);
+	rows_touch(t);
+	perf_open(ctx);
+	if (! nb_workers) run_wait_start();
+
+#	ifndef NDEBUG
+	printf("thread %u: starting...\n", t);
+#	endif
+
+	unsigned *claimed = ctx->claimed;
+	unsigned wanted[nb_claimed];
+	bool shared[nb_claimed];
+	uint64_t acquired_at[nb_claimed];	// for the profile
+	// Only methods with a shared mode get shared claims, which they take exclusively if they must
+	uint64_t const threshold = methods[method].lock_shared ? shared_threshold : 0;
+	bool const use_shared = methods[method].lock_shared && (shared_threshold || replay_nb_threads);
+	bool restart = false;	// previous job failed
+	bool retry = false;	// and we try it again
+	bool redo = false;	// previous job done but invalidated, so done again
+	unsigned retries = 0;	// of the current job
+	uint64_t job_start = 0;
+	int ph;
+	while ((ph = __atomic_load_n(&phase, __ATOMIC_ACQUIRE)) != PHASE_DRAIN) {
+		if (given_up(ctx)) goto given_up;
+		if (! retry && replay_nb_threads && ctx->replay_next >= replay_first[t+1] - replay_first[t]) break;
+		bool const measuring = ph == PHASE_MEASURE;
+		unsigned l, c = 0;
+		if (measuring && ! redo) COUNTER_INC(ctx->nb_trys);
+		uint64_t const now = now_ns();
+		if (! retry && ! redo) {
+			if (replay_nb_threads) {
+				size_t const j = (size_t)(replay_first[t] + ctx->replay_next++) * nb_claimed;
+				for (l = 0; l < nb_claimed; l++) {
+					wanted[l] = replay_locks[j + l];
+					shared[l] = use_shared && replay_shared[j + l];
+				}
+			} else for (l = 0; l < nb_claimed; l++) {
+				wanted[l] = pick_lock(ctx, t);
+				shared[l] = threshold && (rand_next(ctx) >> 32) < threshold;
+			}
+			trace_add(ctx, t, EV_JOB, 0, false);
+			for (l = 0; l < nb_claimed; l++) trace_add(ctx, t, EV_CLAIM, wanted[l], shared[l]);
+			job_start = now;
+			retries = 0;
+		}
+		if (! restart && ! redo) __atomic_store_n(&ctx->job_ts, now, __ATOMIC_RELAXED);
+		__atomic_store_n(&ctx->wounded, false, __ATOMIC_RELAXED);
+		if (use_lock_set && methods[method].lock_set) {
+#			ifndef NDEBUG
+			printf("thread %u: taking %u locks at once\n", t, nb_claimed);
+#			endif
+			for (c = 0; c < nb_claimed; c++) trace_add(ctx, t, EV_TRY, wanted[c], shared[c]);
+			uint64_t const start = now_ns();
+			__atomic_store_n(&ctx->waiting, wanted[0], __ATOMIC_RELAXED);	// or any other of the set
+			perf_start(ctx);
+			int const err = methods[method].lock_set(t, wanted, use_shared ? shared : NULL, nb_claimed);
+			perf_stop(ctx);
+			if (given_up(ctx)) goto given_up;
+			__atomic_store_n(&ctx->waiting, UINT_MAX, __ATOMIC_RELAXED);
+			uint64_t const stop = now_ns();
+			__atomic_store_n(&ctx->last_progress, stop, __ATOMIC_RELAXED);
+			if (profile_top && measuring) {
+				for (c = 0; c < nb_claimed; c++) {
+					profile_wait(wanted[c], stop - start, 0 == err);
+					acquired_at[c] = stop;
+				}
+			}
+			if (0 == err) {
+				if (measuring) histo_add(ctx->histos+HIST_ACQUIRE, stop - start);
+				for (c = 0; c < nb_claimed; c++) {
+					__atomic_store_n(claimed+c, wanted[c], __ATOMIC_RELAXED);
+					trace_add(ctx, t, EV_ACQUIRED, wanted[c], shared[c]);
+				}
+				__atomic_store_n(&ctx->nb_held, c, __ATOMIC_RELEASE);
+				l = nb_claimed;
+			} else {
+				if (measuring) {
+					histo_add(ctx->histos+HIST_REJECT, stop - start);
+					if (! retry) histo_add(ctx->histos+HIST_FIRST_FAIL, stop - job_start);
+					COUNTER_INC(ctx->nb_errs);
+				}
+				trace_add(ctx, t, EV_REJECTED, wanted[0], shared[0]);
+				c = l = 0;
+			}
+		} else for (l = 0; l < nb_claimed; l++) {
+			unsigned const lock = wanted[l];
+#			ifndef NDEBUG
+			printf("thread %u: taking lock %u\n", t, lock);
+#			endif
+			trace_add(ctx, t, EV_TRY, lock, shared[l]);
+			uint64_t const start = now_ns();
+			__atomic_store_n(&ctx->waiting, lock, __ATOMIC_RELAXED);
+			perf_start(ctx);
+			int const err = shared[l] && methods[method].lock_shared ?
+				methods[method].lock_shared(t, lock) : methods[method].lock(t, lock);
+			perf_stop(ctx);
+			if (given_up(ctx)) goto given_up;
+			__atomic_store_n(&ctx->waiting, UINT_MAX, __ATOMIC_RELAXED);
+			if (0 == err) {
+				uint64_t const stop = now_ns();
+				__atomic_store_n(&ctx->last_progress, stop, __ATOMIC_RELAXED);
+				if (measuring) {
+					histo_add(ctx->histos+HIST_ACQUIRE, stop - start);
+					if (profile_top) profile_wait(lock, stop - start, true);
+				}
+				acquired_at[c] = stop;
+				trace_add(ctx, t, EV_ACQUIRED, lock, shared[l]);
+				__atomic_store_n(claimed+c, lock, __ATOMIC_RELAXED);
+				__atomic_store_n(&ctx->nb_held, ++c, __ATOMIC_RELEASE);
+			} else {
+				uint64_t const stop = now_ns();
+				__atomic_store_n(&ctx->last_progress, stop, __ATOMIC_RELAXED);
+				if (measuring) {
+					histo_add(ctx->histos+HIST_REJECT, stop - start);
+					if (! retry) histo_add(ctx->histos+HIST_FIRST_FAIL, stop - job_start);
+					if (profile_top) profile_wait(lock, stop - start, false);
+					COUNTER_INC(ctx->nb_errs);
+				}
+				trace_add(ctx, t, EV_REJECTED, lock, shared[l]);
+#				ifndef NDEBUG
+				printf("thread %u: failed to lock %u\n", t, lock);
+#				endif
+				break;
+			}
+#			ifndef NDEBUG
+			printf("thread %u: took lock %u\n", t, lock);
+#			endif
+		}
+		if (l == nb_claimed) {	// do some work with the locks
+			uint64_t const start = now_ns();
+			do_job(ctx, wanted, shared);
+			if (measuring) histo_add(ctx->histos+HIST_HOLD, now_ns() - start);
+			if (given_up(ctx)) goto given_up;
+		}
+		bool const invalid = l == nb_claimed && methods[method].validate && 0 != methods[method].validate(t);
+		// Release all that was locked
+		while (c --) {
+#			ifndef NDEBUG
+			printf("thread %u: releasing lock %u\n", t, claimed[c]);
+#			endif
+			if (given_up(ctx)) goto given_up;
+			if (profile_top && measuring) profile_hold(claimed[c], now_ns() - acquired_at[c]);
+			perf_start(ctx);
+			methods[method].unlock(t, claimed[c]);
+			perf_stop(ctx);
+			trace_add(ctx, t, EV_RELEASED, claimed[c], false);
+			__atomic_store_n(&ctx->nb_held, c, __ATOMIC_RELAXED);
+#			ifndef NDEBUG
+			printf("thread %u: released lock %u\n", t, claimed[c]);
+#			endif
+		}
+		__atomic_store_n(&ctx->last_progress, now_ns(), __ATOMIC_RELAXED);
+
+		bool const failed = l < nb_claimed;
+		retry = failed && retry_policy != RETRY_NONE;
+		if (retry && retries >= max_retries) {
+			if (measuring) COUNTER_INC(ctx->nb_given_up);
+			retry = false;
+		}
+		restart = retry || (failed && retry_policy == RETRY_NONE);
+		if (retry) {
+			if (measuring) COUNTER_INC(ctx->nb_retries);
+			backoff(ctx, retries++);
+		}
+		redo = invalid;
+		if (nb_workers) task_yield(t);	// one job at a time
+	}
+
+	perf_close(ctx);
+	pthread_mutex_lock(&run_lock);
+	ctx->done = true;
+	nb_running --;
+	pthread_cond_broadcast(&run_cond);
+	pthread_mutex_unlock(&run_lock);
+
+	return NULL;
+
+given_up:	// keeping the locks of this run, that no thread of the next ones will ever see
+#	ifndef NDEBUG
+	printf("thread %u: given up on, exiting\n", t);
+#	endif
+	perf_close(ctx);
+	return NULL;
+}
+
+/*
+ * Watchdog: when no thread made any progress for watchdog_msec while they all wait for a
+ * lock, and none of those waits is bounded, we are deadlocked. Report the wait-for graph and
+ * give up on the run.
+ */
+
+static unsigned watchdog_msec = 1000;	// 0 to disable
+static pthread_t watchdog_id;
+static uint64_t run_start;
+static bool watchdog_stop;	// protected by run_lock
+static double deadlock_after;	// time to deadlock, in seconds, or negative (protected by run_lock)
+
+static void dump_wait_graph(void)
+{
+	unsigned *owner = malloc(nb_locks * sizeof(*owner));
+	unsigned *visit = calloc(nb_threads, sizeof(*visit));
+	if (! owner || ! visit) {
+		fprintf(stderr, "Cannot alloc.\n");
+		free(owner);
+		free(visit);
+		return;
+	}
+	for (unsigned l = 0; l < nb_locks; l++) owner[l] = UINT_MAX;
+
+	unsigned nb_waiting = 0;
+	for (unsigned t = 0; t < nb_threads; t++) {
+		struct thread_ctx const *ctx = thread_ctxs + t;
+		unsigned const nb_held = __atomic_load_n(&ctx->nb_held, __ATOMIC_ACQUIRE);
+		unsigned const waiting = __atomic_load_n(&ctx->waiting, __ATOMIC_RELAXED);
+		if (waiting != UINT_MAX) nb_waiting ++;
+		if (verbose) printf("thread %u holds", t);
+		for (unsigned c = 0; c < nb_held; c++) {
+			unsigned const l = __atomic_load_n(ctx->claimed+c, __ATOMIC_RELAXED);
+			owner[l] = t;
+			if (verbose) printf(" %u", l);
+		}
+		if (verbose) {
+			if (waiting != UINT_MAX) printf(", waits for %u\n", waiting);
+			else printf(", waits for nothing\n");
+		}
+	}
+	printf("%u threads waiting\n", nb_waiting);
+
+	// Follow the edges from each waiting thread to print the loops
+	for (unsigned t = 0; t < nb_threads; t++) {
+		unsigned tt = t;
+		while (tt != UINT_MAX && ! visit[tt]) {
+			visit[tt] = t+1;
+			unsigned const l = __atomic_load_n(&thread_ctxs[tt].waiting, __ATOMIC_RELAXED);
+			tt = l == UINT_MAX ? UINT_MAX : owner[l];
+		}
+		if (tt == UINT_MAX || visit[tt] != t+1) continue;	// no new loop
+		printf("loop: thread %u", tt);
+		unsigned const first = tt;
+		do {
+			unsigned const l = thread_ctxs[tt].waiting;
+			tt = owner[l];
+			printf(" -> lock %u -> thread %u", l, tt);
+		} while (tt != first);
+		printf("\n");
+	}
+
+	free(owner);
+	free(visit);
+}
+
+// Whether that thread waits for a lock without any bound on the wait
+static bool thread_stuck(struct thread_ctx const *ctx)
+{
+	// Timed waits (TimedLock, AdaptiveTimed, wound-wait slices) get out of deadlocks by themselves
+	return __atomic_load_n(&ctx->waiting, __ATOMIC_RELAXED) != UINT_MAX &&
+		! __atomic_load_n(&ctx->timed_wait, __ATOMIC_RELAXED);
+}
+
+static void *watchdog_run(void *dummy)
+{
+	(void)dummy;
+	pthread_mutex_lock(&run_lock);
+	while (! watchdog_stop) {
+		struct timespec ts;
+		timespec_from_ns(&ts, now_ns() + watchdog_msec * 1000000ULL);
+		pthread_cond_timedwait(&run_cond, &run_lock, &ts);
+		if (watchdog_stop) break;
+
+		uint64_t last_progress = run_start;
+		bool all_waiting = true;
+		for (unsigned t = 0; t < nb_threads; t++) {
+			struct thread_ctx const *ctx = thread_ctxs + t;
+			uint64_t const p = __atomic_load_n(&ctx->last_progress, __ATOMIC_RELAXED);
+			if (p > last_progress) last_progress = p;
+			if (! ctx->done && ! thread_stuck(ctx)) all_waiting = false;
+		}
+		if (nb_running > 0 && all_waiting && now_ns() - last_progress >= watchdog_msec * 1000000ULL) {
+			deadlock_after = (last_progress - run_start) / 1e9;
+			printf("Deadlock detected after %.3fs (no progress for %ums)\n", deadlock_after, watchdog_msec);
+			dump_wait_graph();
+			pthread_cond_broadcast(&run_cond);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&run_lock);
+	return NULL;
+}
+
+static void syntax(void)
+{
+	printf(
+		"lockArena\nusage:\n"
+		" -h            help (this)\n"
+		" -m methods    \"all\" or a comma separated list of:\n");
+	for (unsigned m = 0; m < NB_ELEMS(methods); m++) {
+		printf("                %u: %s\n", m, methods[m].name);
+	}
+	printf(
+		" -L locks      \"all\" or a comma separated list of lock primitives backing the locks:\n"
+		"               pthread (default), padded (one pthread mutex per cache line),\n"
+		"               futex (4 bytes), mcs (queue lock) or rwlock (default with -r)\n"
+		" -t nb_threads\n"
+		" -l nb_locks\n"
+		" -c nb_claim   number of required locks before each job\n"
+		" -s [model:]size  job size, for a model amongst sleep (default, size in microseconds),\n"
+		"               spin (busy loop, size in nanoseconds) or touch (size cache lines of\n"
+		"               each claimed lock payload), ex: spin:200. Jobs last up to size, but touch.\n"
+		"               -t, -l, -c and -s also accept a range first:last[:step] to sweep,\n"
+		"               where step is added, or multiplied if prefixed with x (ex: 1:256:x2, not from 0)\n"
+		" -r ratio      share of the claims that are shared (between 0 and 1, default 0).\n"
+		"               Only methods with a shared mode know about it, and only rwlocks implement it:\n"
+		"               shared claims are taken exclusively otherwise (and counted), but for the\n"
+		"               reads of Optimistic which need no lock\n"
+		" -D dist       how locks are picked: uniform (default), zipf[:theta] (default 0.99),\n"
+		"               hotspot[:x[:y]] (x of the accesses go to y of the locks, default 0.9:0.1)\n"
+		"               or affine[:p] (p of the claims in the thread own partition, default 0.9)\n"
+		" -A place[,mem] pin threads to CPUs, compact (node by node) or scatter (across nodes),\n"
+		"               and place their rows of the Matrix and OrderedLock state on their node\n"
+		"               by first touch (touch) or binding (bind)\n"
+		" -K nb_classes lock classes for Lockdep (lock number modulo nb_classes, default one per lock)\n"
+		" -g size       group locks by ranges of that many for Hierarchical (default 64)\n"
+		" -E file[,events]  trace the last events (default 16384, a power of 2) of each thread\n"
+		"               in that file (the following runs in file.1, file.2...)\n"
+		" -X file       replay the jobs of a trace (overriding -t, -l and -c), each thread\n"
+		"               stopping after its last job or after the duration\n"
+		" -d duration   measurement duration in seconds (may be fractional)\n"
+		" -W msec       warm-up before the measurement (default 0)\n"
+		" -k msec       give up on the threads still running that long after the measurement\n"
+		"               as if deadlocked (default 10000, 0 to wait forever)\n"
+		" -T timeout    for timedlocks (in nanoseconds), upper bound for adaptive ones\n"
+		" -S seed       seed for the random generators (default: from the time)\n"
+		" -b            take locks one by one even if the method can take the whole set at once\n"
+		" -R policy[,max]  retry failed jobs with the same locks, after a backoff policy amongst\n"
+		"               none (default: start a new job instead), exp, jitter (random exp) or yield,\n"
+		"               at most max times (default 100)\n"
+		" -w msec       watchdog: declare a deadlock after that long without progress (0 to disable)\n"
+		"               exit status is then 2\n"
+		" -o file       also write a record per run in that file (JSON if it ends with .json,\n"
+		"               CSV otherwise, - for stdout)\n"
+		" -p top[,file] profile each lock: print the top most rejected (then waited for) locks,\n"
+		"               and all of them in that CSV file if given (- for stdout)\n"
+		" -n workers    run the threads as tasks on that many worker threads, yielding instead of\n"
+		"               blocking (not with rwlock locks, nor -P). Each task gets a stack of\n"
+		"               256KiB plus about 512 bytes per thread, reserved but only used as needed\n"
+		" -P            count cycles, instructions, cache misses and context switches during lock\n"
+		"               and unlock calls, where available (adds two syscalls per call to the latencies)\n"
+		" -v            verbose: also report per thread counters\n");
+}
+
+struct result {
+	unsigned method, primitive;
+	unsigned nb_threads, nb_locks, nb_claimed;
+	enum job_model job_model;
+	unsigned job_size;
+	double shared_ratio;
+	char const *distribution;
+	enum placement placement;
+	enum mem_policy mem_policy;
+	double duration;	// actual measurement duration, in seconds
+	uint64_t nb_trys, nb_errs;
+	uint64_t nb_retries, nb_given_up;
+	uint64_t nb_excl_shared;
+	uint64_t min_jobs, max_jobs;	// per thread
+	struct histo_sum histos[NB_HISTOS];
+	double deadlock_after;	// time to deadlock in seconds, or negative if none
+	uint64_t perf_calls;	// calls measured with -P
+	int64_t perf_counts[NB_PERF_COUNTERS];	// negative if unavailable
+};
+
+static void collect(struct result *res)
 {
-	(void)t;
-	return pthread_mutex_lock(locks+l);
+	res->method = method;
+	res->primitive = primitive;
+	res->nb_threads = nb_threads;
+	res->nb_locks = nb_locks;
+	res->nb_claimed = nb_claimed;
+	res->job_model = job_model;
+	res->job_size = job_size;
+	res->shared_ratio = methods[method].lock_shared ? shared_ratio : 0.;
+	res->distribution = dist_desc;
+	res->placement = placement;
+	res->mem_policy = mem_policy;
+	res->nb_trys = res->nb_errs = res->max_jobs = 0;
+	res->nb_retries = res->nb_given_up = res->nb_excl_shared = 0;
+	res->min_jobs = UINT64_MAX;
+	memset(res->histos, 0, sizeof(res->histos));
+	res->perf_calls = 0;
+	for (unsigned c = 0; c < NB_PERF_COUNTERS; c++) res->perf_counts[c] = perf_enabled && perf_ok[c] ? 0 : -1;
+	for (unsigned t = 0; t < nb_threads; t++) {
+		uint64_t const trys = COUNTER_GET(thread_ctxs[t].nb_trys);
+		uint64_t const errs = COUNTER_GET(thread_ctxs[t].nb_errs);
+		uint64_t const jobs = trys - errs;
+		res->nb_trys += trys;
+		res->nb_errs += errs;
+		res->nb_retries += COUNTER_GET(thread_ctxs[t].nb_retries);
+		res->nb_given_up += COUNTER_GET(thread_ctxs[t].nb_given_up);
+		res->nb_excl_shared += COUNTER_GET(thread_ctxs[t].nb_excl_shared);
+		if (jobs < res->min_jobs) res->min_jobs = jobs;
+		if (jobs > res->max_jobs) res->max_jobs = jobs;
+		if (verbose) {
+			printf("thread %u: %"PRIu64" jobs done, %"PRIu64" errors\n", t, jobs, errs);
+		}
+		for (unsigned k = 0; k < NB_HISTOS; k++) histo_merge(res->histos+k, thread_ctxs[t].histos+k);
+		// Performance counters are read by the threads when they exit
+		if (!thread_ctxs[t].done) continue;
+		res->perf_calls += thread_ctxs[t].perf_calls;
+		for (unsigned c = 0; c < NB_PERF_COUNTERS; c++) {
+			if (res->perf_counts[c] < 0) continue;
+			if (thread_ctxs[t].perf_counts[c] < 0) res->perf_counts[c] = -1;
+			else res->perf_counts[c] += thread_ctxs[t].perf_counts[c];
+		}
+	}
 }
 
-static void just_unlock(unsigned t, unsigned l)
+// Average count per measured call, or negative if unavailable
+static double perf_per_call(struct result const *res, unsigned c)
 {
-	(void)t;
-	(void)pthread_mutex_unlock(locks+l);
+	if (res->perf_counts[c] < 0 || !res->perf_calls) return -1.;
+	return (double)res->perf_counts[c] / res->perf_calls;
 }
 
-/*
- * Dependency tracking (simple method)
- * Requires an additional global lock, but prevents deadlocks instead of detecting them afterward.
- * In number of threads or number of locks is really high a sparse representation would be required.
- */
-
-static pthread_mutex_t m_lock = PTHREAD_MUTEX_INITIALIZER;
-#define NB_BITS_PER_CELL 64
-static uint64_t *thread_wq;	// list of locks we wait or hold, protected by m_lock.
-static unsigned thread_stride;	// stride from one row to the next in the lock matrix
-#define THREAD_HOLD(t, l)  (thread_wq[((t) << thread_stride) + (l)/NB_BITS_PER_CELL] & (1ULL << ((l)%NB_BITS_PER_CELL)))
-#define THREAD_HOLD_GROUP(t, l)  (thread_wq[((t) << thread_stride) + (l)/NB_BITS_PER_CELL])
-#define THREAD_SET(t, l)   (thread_wq[((t) << thread_stride) + (l)/NB_BITS_PER_CELL] |= (1ULL << ((l)%NB_BITS_PER_CELL)))
-#define THREAD_CLEAR(t, l) (thread_wq[((t) << thread_stride) + (l)/NB_BITS_PER_CELL] &= ~(1ULL << ((l)%NB_BITS_PER_CELL)))
-
-// This method allow us to detect recursive locks easily
-static unsigned *recurs_count; 	// how many times each mutex is locked (protected by the lock itself, ensure you have it first!)
-
-static unsigned upper_multiple_of(unsigned n, unsigned m)
+static void report(struct result const *res)
 {
-	unsigned u = m;
-	unsigned l = 1;
-	while (u < n) {
-		u += m;
-		l ++;
+	uint64_t const nb_jobs = res->nb_trys - res->nb_errs;
+	printf("%"PRIu64" jobs done, %"PRIu64" errors (%.2f%%)\n", nb_jobs, res->nb_errs, (100.*res->nb_errs)/res->nb_trys);
+	printf("jobs per thread: min %"PRIu64", avg %.1f, max %"PRIu64"\n", res->min_jobs, (double)nb_jobs/nb_threads, res->max_jobs);
+	if (retry_policy != RETRY_NONE) {
+		printf("goodput: %.0f jobs/s, %"PRIu64" retries (%.2f per job done), %"PRIu64" jobs given up\n",
+			nb_jobs / res->duration, res->nb_retries, nb_jobs ? (double)res->nb_retries / nb_jobs : 0.,
+			res->nb_given_up);
+	}
+	if (res->nb_excl_shared) {
+		printf("%"PRIu64" shared claims taken exclusively, %s locks having no shared mode\n",
+			res->nb_excl_shared, primitives[res->primitive].name);
+	}
+
+	printf("%-14s %12s %12s %12s %12s %12s\n", "latency (ns)", "samples", "p50", "p99", "p999", "max");
+	for (unsigned k = 0; k < NB_HISTOS; k++) {
+		struct histo_sum const *h = res->histos+k;
+		printf("%-14s %12"PRIu64" %12"PRIu64" %12"PRIu64" %12"PRIu64" %12"PRIu64"\n",
+			histo_names[k], h->total, histo_percentile(h, .5), histo_percentile(h, .99),
+			histo_percentile(h, .999), h->max);
+	}
+	if (perf_enabled) {
+		printf("per lock/unlock call (%"PRIu64" calls):", res->perf_calls);
+		for (unsigned c = 0; c < NB_PERF_COUNTERS; c++) {
+			double const v = perf_per_call(res, c);
+			if (v < 0) printf(" %s n/a", perf_counters[c].name);
+			else printf(" %s %.2f%s", perf_counters[c].name, v, perf_user_only[c] ? " (user)" : "");
+			printf(c < NB_PERF_COUNTERS-1 ? "," : "\n");
+		}
 	}
-	return l;
 }
 
-// starting from (t, l) can we go back to target thread?
-// As we are supposed to be cycle free we do not have to tag the matrix along the way.
-static bool is_looping(unsigned t, unsigned l, unsigned target)
+static void report_comparison(struct result const *res, unsigned nb_res)
 {
-	for (unsigned ll = 0; ll < nb_locks; ll ++) {
-		if (0 == (ll&(NB_BITS_PER_CELL-1))) {
-			if (! THREAD_HOLD_GROUP(t, ll)) {
-				ll += NB_BITS_PER_CELL-1;
-				continue;
-			}
-		}
-		if (! THREAD_HOLD(t, ll)) continue;
-		if (ll == l) continue;	// we are not allowed to proceed to where we come from
-		for (unsigned tt = 0; tt < nb_threads; tt ++) {
-			if (! THREAD_HOLD(tt, ll)) continue;
-			if (tt == t) continue;
-			if (tt == target) return true;
-			if (is_looping(tt, ll, target)) return true;
+	printf("\n%-14s %-8s %12s %8s %8s %12s %12s %12s %12s %10s\n",
+		"method", "locks", "jobs/s", "errors", "retries", "acq p50", "acq p99", "acq p999", "rej p99", "deadlock");
+	for (unsigned r = 0; r < nb_res; r++) {
+		struct histo_sum const *acq = res[r].histos+HIST_ACQUIRE;
+		char deadlock[32] = "-";
+		if (res[r].deadlock_after >= 0) snprintf(deadlock, sizeof(deadlock), "%.3fs", res[r].deadlock_after);
+		uint64_t const nb_jobs = res[r].nb_trys - res[r].nb_errs;
+		printf("%-14s %-8s %12.0f %7.2f%% %8.2f %12"PRIu64" %12"PRIu64" %12"PRIu64" %12"PRIu64" %10s\n",
+			methods[res[r].method].name, primitives[res[r].primitive].name, nb_jobs / res[r].duration, (100.*res[r].nb_errs)/res[r].nb_trys,
+			nb_jobs ? (double)res[r].nb_retries / nb_jobs : 0., histo_percentile(acq, .5), histo_percentile(acq, .99),
+			histo_percentile(acq, .999), histo_percentile(res[r].histos+HIST_REJECT, .99), deadlock);
+	}
+	if (!perf_enabled) return;
+	printf("\n%-14s %-8s", "per call", "locks");
+	for (unsigned c = 0; c < NB_PERF_COUNTERS; c++) printf(" %12s", perf_counters[c].name);
+	printf("\n");
+	for (unsigned r = 0; r < nb_res; r++) {
+		printf("%-14s %-8s", methods[res[r].method].name, primitives[res[r].primitive].name);
+		for (unsigned c = 0; c < NB_PERF_COUNTERS; c++) {
+			double const v = perf_per_call(res+r, c);
+			if (v < 0) printf(" %12s", "n/a");
+			else printf(" %12.2f", v);
 		}
+		printf("\n");
 	}
-
-	return false;
 }
 
-static int matrix_lock(unsigned t, unsigned l)
+/*
+ * The arena (threads, locks and their contexts) is allocated once for the largest run
+ * and reinitialized for each run.
+ */
+
+static unsigned arena_threads, arena_locks, arena_claims;
+static unsigned *thread_claims;	// arena_claims per thread
+
+static int arena_alloc(unsigned max_threads, unsigned max_locks, unsigned max_claims)
 {
-	if (recurs_count[t * nb_locks + l] > 0) {
-		recurs_count[t * nb_locks + l]++;
-#		ifndef NDEBUG
-		printf("thread %u: already got lock %u\n", t, l);
-#		endif
-		return 0;
+	arena_threads = max_threads;
+	arena_locks = max_locks;
+	arena_claims = max_claims;
+	pthread_ids = malloc(max_threads * sizeof(*pthread_ids));
+	size_t lock_size = 0;
+	for (unsigned p = 0; p < NB_ELEMS(primitives); p++) {
+		if (primitives[p].size > lock_size) lock_size = primitives[p].size;
 	}
-
-	if (0 != pthread_mutex_lock(&m_lock)) {
-		assert(!"Cannot lock m_lock!?");
+	if (0 != posix_memalign((void **)&locks, CACHE_LINE, max_locks * lock_size)) {
+		locks = NULL;
+	}
+	thread_claims = malloc((size_t)max_threads * max_claims * sizeof(*thread_claims));
+	if (profile_top && 0 != posix_memalign((void **)&lock_stats, CACHE_LINE, max_locks * sizeof(*lock_stats))) {
+		lock_stats = NULL;
+	}
+	if (0 != posix_memalign((void **)&thread_ctxs, CACHE_LINE, max_threads * sizeof(*thread_ctxs))) {
+		thread_ctxs = NULL;
+	}
+	if (!pthread_ids || !locks || !thread_claims || !thread_ctxs || (profile_top && !lock_stats)) {
+		fprintf(stderr, "Cannot alloc.\n");
+		return -1;
 	}
+	return 0;
+}
 
-	assert(! THREAD_HOLD(t, l));
+static void arena_free(void)
+{
+	free(pthread_ids);
+	free(locks);
+	free(thread_claims);
+	free(lock_stats);
+	free(thread_ctxs);
+}
 
-	for (unsigned tt = 0; tt < nb_threads; tt ++) {
-		if (! THREAD_HOLD(tt, l)) continue;
-		if (is_looping(tt, l, t)) {
-#			ifndef NDEBUG
-			printf("thread %u: lock %u would deadlock\n", t, l);
-#			endif
-			pthread_mutex_unlock(&m_lock);
+// Wait until cond is true, a deadlock is detected or the deadline (0 for none) is reached.
+// Must be called with run_lock.
+#define RUN_WAIT(cond, deadline) do { \
+	struct timespec ts_; \
+	timespec_from_ns(&ts_, deadline); \
+	while (!(cond) && deadlock_after < 0) { \
+		if (deadline) { \
+			if (ETIMEDOUT == pthread_cond_timedwait(&run_cond, &run_lock, &ts_)) break; \
+		} else pthread_cond_wait(&run_cond, &run_lock); \
+	} \
+} while (0)
 
-			return -1;
+/* Once given up on, wait for the threads that can still finish their job and exit, until the
+ * remaining ones are all stuck on two checks in a row, so that none is left behind halfway
+ * through the method state. Must be called with run_lock. */
+#define SETTLE_NSEC 10000000ULL
+static void run_settle(void)
+{
+	unsigned nb_stuck_checks = 0;
+	while (nb_running > 0 && nb_stuck_checks < 2) {
+		struct timespec ts;
+		timespec_from_ns(&ts, now_ns() + SETTLE_NSEC);
+		pthread_cond_timedwait(&run_cond, &run_lock, &ts);
+		bool all_stuck = true;
+		for (unsigned t = 0; t < nb_threads; t++) {
+			if (! thread_ctxs[t].done && ! thread_stuck(thread_ctxs+t)) all_stuck = false;
 		}
+		nb_stuck_checks = all_stuck ? nb_stuck_checks + 1 : 0;
 	}
+}
 
-#	ifndef NDEBUG
-	printf("thread %u: can safely wait for lock %u\n", t, l);
-#	endif
-	THREAD_SET(t, l);
-	pthread_mutex_unlock(&m_lock);	// since I've said that I'm waiting for the lock I can safely release m_lock
-
-	recurs_count[t * nb_locks + l] = 1;
-	if (0 != pthread_mutex_lock(locks+l)) {
-		assert(!"Cannot take lock?!");
+// Release what a run set up, once all its threads are gone
+static void run_fini(void)
+{
+	trace_fini();
+	payload_fini();
+	dist_fini();
+	if (methods[method].fini) methods[method].fini();
+	if (primitives[primitive].destroy) {
+		for (unsigned m = 0; m < nb_locks; m++) {
+			primitives[primitive].destroy(LOCK_AT(m));
+		}
 	}
-	return 0;
+	if (primitives[primitive].teardown) primitives[primitive].teardown();
 }
 
-static void matrix_unlock(unsigned t, unsigned l)
+// Run the current method once with the current parameters
+static int run(struct result *res)
 {
-	if (--recurs_count[t * nb_locks + l] > 0) {
-		return;
+	assert(nb_threads <= arena_threads && nb_locks <= arena_locks && nb_claimed <= arena_claims);
+	printf(
+		"Running %u threads, taking %u locks (amongst %u, %s) before a %s job of up to %u%s, "
+		"using method %s on %s locks, repeating for %gsecs...\n",
+		nb_threads, nb_claimed, nb_locks, dist_desc, job_model_names[job_model], job_size, job_model_units[job_model], methods[method].name, primitives[primitive].name, duration);
+	if (nb_workers) printf("Threads run as tasks on %u workers\n", nb_workers < nb_threads ? nb_workers : nb_threads);
+
+	nb_placed_rows = 0;	// forget about the ones leaked by a deadlocked run
+	if (primitives[primitive].setup && 0 != primitives[primitive].setup()) {
+		fprintf(stderr, "Cannot alloc.\n");
+		if (primitives[primitive].teardown) primitives[primitive].teardown();
+		return -1;
+	}
+	if (methods[method].init && 0 != methods[method].init()) {
+		fprintf(stderr, "Cannot alloc.\n");
+		if (methods[method].fini) methods[method].fini();
+		if (primitives[primitive].teardown) primitives[primitive].teardown();
+		return -1;
+	}
+	if (0 != dist_init() || 0 != payload_init()) {
+		fprintf(stderr, "Cannot alloc.\n");
+		payload_fini();
+		dist_fini();
+		if (methods[method].fini) methods[method].fini();
+		if (primitives[primitive].teardown) primitives[primitive].teardown();
+		return -1;
 	}
 
-	if (0 != pthread_mutex_lock(&m_lock)) {
-		assert(!"Cannot lock m_lock!?");
+	for (unsigned m = 0; m < nb_locks; m++) {
+		primitives[primitive].init(LOCK_AT(m));
+	}
+	memset(thread_ctxs, 0, nb_threads * sizeof(*thread_ctxs));
+	if (profile_top) memset(lock_stats, 0, nb_locks * sizeof(*lock_stats));
+	for (unsigned t = 0; t < nb_threads; t++) {
+		thread_ctxs[t].waiting = UINT_MAX;
+		thread_ctxs[t].gen = run_gen;
+		thread_ctxs[t].claimed = thread_claims + t * arena_claims;
+	}
+	if (0 != trace_init()) return -1;
+	if (nb_workers && 0 != tasks_init()) {
+		fprintf(stderr, "Cannot alloc.\n");
+		tasks_fini();
+		return -1;
+	}
+
+	__atomic_store_n(&phase, warmup_msec ? PHASE_WARMUP : PHASE_MEASURE, __ATOMIC_RELAXED);
+	watchdog_stop = false;
+	deadlock_after = -1;
+	nb_running = nb_threads;
+	unsigned const nb_os_threads = nb_workers ? pool_size : nb_threads;
+	nb_starting = nb_os_threads + 1;
+	unsigned nb_created;
+	int err = 0;
+	for (nb_created = 0; nb_created < nb_os_threads; nb_created++) {
+		pthread_attr_t attr;
+		pthread_attr_init(&attr);
+		if (placement != PLACE_NONE) place_thread_attr(&attr, nb_created);
+		err = pthread_create(pthread_ids+nb_created, &attr, nb_workers ? worker_run : thread_run, (void *)(intptr_t)nb_created);
+		pthread_attr_destroy(&attr);
+		if (err) break;
+	}
+	if (err) {
+		fprintf(stderr, "Cannot create thread %u: %s\n", nb_created, strerror(err));
+		// Have the created ones exit as soon as they start
+		__atomic_store_n(&run_gen, run_gen + 1, __ATOMIC_RELEASE);
+		pthread_mutex_lock(&run_lock);
+		nb_starting -= nb_os_threads - nb_created;
+		pthread_mutex_unlock(&run_lock);
+	}
+	run_wait_start();
+	if (err) {
+		for (unsigned t = 0; t < nb_created; t++) pthread_join(pthread_ids[t], NULL);
+		if (nb_workers) tasks_fini();
+		run_fini();
+		return -1;
+	}
+	run_start = now_ns();
+	bool watchdog_started = false;
+	if (watchdog_msec > 0) {
+		watchdog_started = 0 == pthread_create(&watchdog_id, NULL, watchdog_run, NULL);
+		if (! watchdog_started) fprintf(stderr, "Cannot create the watchdog, running without it\n");
 	}
 
-	THREAD_CLEAR(t, l);
+	// Replaying threads may be done before the end of any phase
+	pthread_mutex_lock(&run_lock);
+	uint64_t measure_start = run_start;
+	if (warmup_msec) {
+		RUN_WAIT(nb_running == 0, run_start + warmup_msec * 1000000ULL);
+		measure_start = now_ns();
+		__atomic_store_n(&phase, PHASE_MEASURE, __ATOMIC_RELEASE);
+	}
+	RUN_WAIT(nb_running == 0, measure_start + (uint64_t)(duration * 1e9));
+	uint64_t const measure_stop = now_ns();
+	__atomic_store_n(&phase, PHASE_DRAIN, __ATOMIC_RELEASE);
+	res->duration = (measure_stop - measure_start) / 1e9;
 
-	pthread_mutex_unlock(&m_lock);
+	printf("Exiting... (if no deadlocks...)\n");
+	RUN_WAIT(nb_running == 0, drain_msec ? measure_stop + drain_msec * 1000000ULL : 0);
+	if (nb_running > 0 && deadlock_after < 0) {
+		deadlock_after = (now_ns() - run_start) / 1e9;
+		printf("%u threads still running %ums after the end, giving up on them\n", nb_running, drain_msec);
+	}
+	watchdog_stop = true;
+	pthread_cond_broadcast(&run_cond);
+	res->deadlock_after = deadlock_after;
+	collect(res);
+	if (! nb_workers && res->deadlock_after >= 0) {
+		run_settle();
+		if (nb_running > 0) printf("%u threads stuck, leaving them behind\n", nb_running);
+	}
+	unsigned const nb_left = nb_workers ? 0 : nb_running;
+	pthread_mutex_unlock(&run_lock);
+	if (watchdog_started) pthread_join(watchdog_id, NULL);
+	if (nb_workers) {	// suspended tasks can just be dropped, even deadlocked ones
+		if (res->deadlock_after >= 0) __atomic_store_n(&workers_stop, true, __ATOMIC_RELAXED);
+		for (unsigned w = 0; w < pool_size; w++) {
+			pthread_join(pthread_ids[w], NULL);
+		}
+	}
+	report(res);
+	trace_dump(run_start);	// deadlocked threads will not write anymore
 
-	(void)pthread_mutex_unlock(locks+l);
+	if (nb_workers) {
+		tasks_fini();
+	} else if (nb_left > 0) {
+		/* Stuck threads will never return, and still use the arena and the method private
+		 * state: leave them alone and start over with a new arena. Should one get the lock
+		 * it waits for after all, it exits as soon as it notices. */
+		__atomic_store_n(&run_gen, run_gen + 1, __ATOMIC_RELEASE);
+		for (unsigned t = 0; t < nb_threads; t++) {
+			pthread_detach(pthread_ids[t]);
+		}
+		return arena_alloc(arena_threads, arena_locks, arena_claims);
+	} else {
+		for (unsigned t = 0; t < nb_threads; t++) {
+			pthread_join(pthread_ids[t], NULL);
+		}
+	}
+	profile_report();
+	run_fini();
+
+	return 0;
 }
 
 /*
- * Detect (using pthread_timed_lock) rather than prevent
+ * Parameter sweeps
  */
 
-static int timed_lock(unsigned t, unsigned l)
+struct range {
+	unsigned first, last, step;
+	bool geometric;	// multiply by step instead of adding it
+};
+
+// Parse "first[:last[:[x]step]]". Returns false on error.
+static bool parse_range(char const *str, struct range *r)
 {
-	(void)t;
+	char *end;
+	r->first = r->last = strtoul(str, &end, 0);
+	r->step = 1;
+	r->geometric = false;
+	if (end == str) return false;
+	if (*end == ':') {
+		str = end+1;
+		r->last = strtoul(str, &end, 0);
+		if (end == str || r->last < r->first) return false;
+		if (*end == ':') {
+			str = end+1;
+			if (*str == 'x') {
+				r->geometric = true;
+				str ++;
+			}
+			r->step = strtoul(str, &end, 0);
+			if (end == str || r->step < (r->geometric ? 2U : 1U)) return false;
+			if (r->geometric && r->first == 0) return false;	// would never move
+		}
+	}
+	return *end == '\0';
+}
 
-	struct timeval now;
-    gettimeofday(&now, NULL);
-	struct timespec timeout = {
-		.tv_sec = now.tv_sec,
-		.tv_nsec = now.tv_usec*1000ULL + timeout_nsec
-	};
-	return pthread_mutex_timedlock(locks+l, &timeout);
+// Returns false once past the last value
+static bool range_next(struct range const *r, unsigned *v)
+{
+	unsigned long long const next = r->geometric ? (unsigned long long)*v * r->step : (unsigned long long)*v + r->step;
+	if (next > r->last) return false;
+	*v = next;
+	return true;
+}
+
+static unsigned range_max(struct range const *r)
+{
+	unsigned v = r->first;
+	while (range_next(r, &v)) ;
+	return v;
 }
 
 /*
- * Prevent deadlock by forcing ordering of taken locks
- * This is easy and fast but will cause a *lot* of rejections, though.
+ * Machine readable output: one record per run, CSV or JSON (one object per line)
  */
 
-static int ordered_lock(unsigned t, unsigned l)
+static FILE *record_file;
+static bool record_json;
+
+static int record_open(char const *path)
 {
-	if (recurs_count[t * nb_locks + l] > 0) {
-		recurs_count[t * nb_locks + l]++;
-		return 0;
+	size_t const len = strlen(path);
+	record_json = len >= 5 && 0 == strcmp(path + len - 5, ".json");
+	record_file = 0 == strcmp(path, "-") ? stdout : fopen(path, "w");
+	if (! record_file) {
+		fprintf(stderr, "Cannot open %s\n", path);
+		return -1;
 	}
-
-	for (unsigned ll = l+1; ll < nb_locks; ll ++) {
-		if (recurs_count[t * nb_locks + ll] > 0) {
-#			ifndef NDEBUG
-			printf("thread %u: cannot take lock %u while holding lock %u\n", t, l, ll);
-#			endif
-			return -1;
+	if (! record_json) {
+		fprintf(record_file, "method,primitive,threads,locks,claims,job_model,job_size,shared_ratio,distribution,placement,mem_policy,duration,jobs,errors,jobs_per_sec,error_rate,retries,given_up,deadlock_after");
+		for (unsigned k = 0; k < NB_HISTOS; k++) {
+			fprintf(record_file, ",%s_p50,%s_p99,%s_p999,%s_max", histo_keys[k], histo_keys[k], histo_keys[k], histo_keys[k]);
 		}
-	}
-
-	recurs_count[t * nb_locks + l] = 1;
-	if (0 != pthread_mutex_lock(locks+l)) {
-		assert(!"Cannot take lock?!");
+		fprintf(record_file, ",lock_calls");
+		for (unsigned c = 0; c < NB_PERF_COUNTERS; c++) fprintf(record_file, ",%s", perf_counters[c].name);
+		fprintf(record_file, "\n");
 	}
 	return 0;
 }
 
-static void ordered_unlock(unsigned t, unsigned l)
+static void record_write(struct result const *res)
 {
-	if (--recurs_count[t * nb_locks + l] > 0) {
-		return;
+	if (! record_file) return;
+	uint64_t const nb_jobs = res->nb_trys - res->nb_errs;
+	double const err_rate = res->nb_trys ? (double)res->nb_errs / res->nb_trys : 0.;
+	char const *fmt = record_json ?
+		"{\"method\":\"%s\",\"primitive\":\"%s\",\"threads\":%u,\"locks\":%u,\"claims\":%u,\"job_model\":\"%s\",\"job_size\":%u,\"shared_ratio\":%.3f,\"distribution\":\"%s\",\"placement\":\"%s\",\"mem_policy\":\"%s\",\"duration\":%.6f,"
+		"\"jobs\":%"PRIu64",\"errors\":%"PRIu64",\"jobs_per_sec\":%.3f,\"error_rate\":%.6f,"
+		"\"retries\":%"PRIu64",\"given_up\":%"PRIu64",\"deadlock_after\":%.6f" :
+		"\"%s\",\"%s\",%u,%u,%u,\"%s\",%u,%.3f,\"%s\",\"%s\",\"%s\",%.6f,%"PRIu64",%"PRIu64",%.3f,%.6f,%"PRIu64",%"PRIu64",%.6f";
+	fprintf(record_file, fmt, methods[res->method].name, primitives[res->primitive].name, res->nb_threads, res->nb_locks, res->nb_claimed,
+		job_model_names[res->job_model], res->job_size, res->shared_ratio, res->distribution,
+		placement_names[res->placement], mem_policy_names[res->mem_policy], res->duration, nb_jobs, res->nb_errs, nb_jobs / res->duration, err_rate,
+		res->nb_retries, res->nb_given_up, res->deadlock_after);
+	for (unsigned k = 0; k < NB_HISTOS; k++) {
+		struct histo_sum const *h = res->histos+k;
+		uint64_t const p50 = histo_percentile(h, .5), p99 = histo_percentile(h, .99), p999 = histo_percentile(h, .999);
+		if (record_json) {
+			fprintf(record_file, ",\"%s\":{\"p50\":%"PRIu64",\"p99\":%"PRIu64",\"p999\":%"PRIu64",\"max\":%"PRIu64"}",
+				histo_keys[k], p50, p99, p999, h->max);
+		} else {
+			fprintf(record_file, ",%"PRIu64",%"PRIu64",%"PRIu64",%"PRIu64, p50, p99, p999, h->max);
+		}
 	}
-
-	(void)pthread_mutex_unlock(locks+l);
+	// Counters are totals over lock_calls, -1 when not measured
+	fprintf(record_file, record_json ? ",\"lock_calls\":%"PRIu64 : ",%"PRIu64, res->perf_calls);
+	for (unsigned c = 0; c < NB_PERF_COUNTERS; c++) {
+		if (record_json) fprintf(record_file, ",\"%s\":%"PRId64, perf_counters[c].name, res->perf_counts[c]);
+		else fprintf(record_file, ",%"PRId64, res->perf_counts[c]);
+	}
+	fprintf(record_file, record_json ? "}\n" : "\n");
+	fflush(record_file);
 }
 
-/*
- * Tests...
- */
-
-static struct {
-	char const *name;
-	int (*lock)(unsigned, unsigned);
-	void (*unlock)(unsigned, unsigned);
-} methods[] = {
-	{ "Just take it", just_lock, just_unlock },
-	{ "Matrix", matrix_lock, matrix_unlock },
-	{ "TimedLock", timed_lock, just_unlock },
-	{ "OrderedLock", ordered_lock, ordered_unlock },
-};
-
-static sig_atomic_t quit = 0;
-
-static void *thread_run(void *idx)
+// Parse "all" or a comma separated list of method numbers. Returns the number of methods, 0 on error.
+static unsigned parse_methods(char const *str, unsigned *list)
 {
-	unsigned const t = (unsigned)(intptr_t)idx;
-
-#	ifndef NDEBUG
-	printf("thread %u: starting...\n", t);
-#	endif
+	unsigned nb = 0;
+	if (0 == strcmp(str, "all")) {
+		for (unsigned m = 0; m < NB_ELEMS(methods); m++) list[nb++] = m;
+		return nb;
+	}
+	while (1) {
+		char *end;
+		unsigned long const m = strtoul(str, &end, 0);
+		if (end == str || m >= NB_ELEMS(methods) || nb >= NB_ELEMS(methods)) return 0;
+		list[nb++] = m;
+		if (*end == '\0') return nb;
+		if (*end != ',') return 0;
+		str = end+1;
+	}
+}
 
-	while (! quit) {
-		unsigned claimed[nb_claimed];
-		unsigned l, c = 0;
-		__sync_add_and_fetch(&nb_trys, 1);
-		for (l = 0; l < nb_claimed; l++) {
-			unsigned const lock = rand() % nb_locks;
-#			ifndef NDEBUG
-			printf("thread %u: taking lock %u\n", t, lock);
-#			endif
-			if (0 == methods[method].lock(t, lock)) {
-				claimed[c++] = lock;
-			} else {
-#				ifndef NDEBUG
-				printf("thread %u: failed to lock %u\n", t, lock);
-#				endif
-				__sync_add_and_fetch(&nb_errs, 1);
-				break;
-			}
-#			ifndef NDEBUG
-			printf("thread %u: took lock %u\n", t, lock);
-#			endif
-		}
-		if (l == nb_claimed) {	// do some work with the locks
-			// Sleep for some time with my locks
-			usleep(rand() % max_sleep_usec);
-		}
-		// Release all that was locked
-		while (c --) {
-#			ifndef NDEBUG
-			printf("thread %u: releasing lock %u\n", t, claimed[c]);
-#			endif
-			methods[method].unlock(t, claimed[c]);
-#			ifndef NDEBUG
-			printf("thread %u: released lock %u\n", t, claimed[c]);
-#			endif
+// Parse "all" or a comma separated list of primitive names. Returns the number of primitives, 0 on error.
+static unsigned parse_primitives(char const *str, unsigned *list)
+{
+	unsigned nb = 0;
+	if (0 == strcmp(str, "all")) {
+		for (unsigned p = 0; p < NB_ELEMS(primitives); p++) list[nb++] = p;
+		return nb;
+	}
+	while (1) {
+		size_t const len = strcspn(str, ",");
+		unsigned p;
+		for (p = 0; p < NB_ELEMS(primitives); p++) {
+			if (strlen(primitives[p].name) == len && 0 == strncmp(str, primitives[p].name, len)) break;
 		}
+		if (p >= NB_ELEMS(primitives) || nb >= NB_ELEMS(primitives)) return 0;
+		list[nb++] = p;
+		if (str[len] == '\0') return nb;
+		str += len+1;
 	}
+}
 
-	return NULL;
+// Parse "compact|scatter[,touch|bind]"
+static int parse_placement(char const *str)
+{
+	size_t const len = strcspn(str, ",");
+	unsigned p, m = MEM_DEFAULT;
+	for (p = PLACE_COMPACT; p < NB_ELEMS(placement_names); p++) {
+		if (strlen(placement_names[p]) == len && 0 == strncmp(str, placement_names[p], len)) break;
+	}
+	if (p >= NB_ELEMS(placement_names)) return -1;
+	if (str[len] == ',') {
+		for (m = MEM_TOUCH; m < NB_ELEMS(mem_policy_names); m++) {
+			if (0 == strcmp(str + len + 1, mem_policy_names[m])) break;
+		}
+		if (m >= NB_ELEMS(mem_policy_names)) return -1;
+	}
+	placement = p;
+	mem_policy = m;
+	return 0;
 }
 
-static void syntax(void)
+static int parse_retry(char const *str)
 {
-	printf(
-		"lockArena\nusage:\n"
-		" -h            help (this)\n"
-		" -m method     0 for no detection, 1 for dependency tracking, 2 for timedlocks\n"
-		" -t nb_threads\n"
-		" -l nb_locks\n"
-		" -c nb_claim   number of required locks before each job\n"
-		" -s usec       job duration (in microseconds)\n"
-		" -d duration   number of seconds before the program (try to) terminate\n"
-		" -T timeout    for timedlocks (in nanoseconds)\n");
+	size_t const len = strcspn(str, ",");
+	unsigned p;
+	for (p = 0; p < NB_ELEMS(retry_names); p++) {
+		if (strlen(retry_names[p]) == len && 0 == strncmp(str, retry_names[p], len)) break;
+	}
+	if (p >= NB_ELEMS(retry_names)) return -1;
+	retry_policy = p;
+	if (str[len] == ',') {
+		char *end;
+		max_retries = strtoul(str + len + 1, &end, 0);
+		if (*end != '\0' || end == str + len + 1) return -1;
+	}
+	return 0;
 }
 
 int main(int nb_args, char **args)
 {
 	int opt;
-	while ((opt = getopt(nb_args, args, "hm:t:l:c:s:d:T:")) != -1) {
+	bool seed_set = false;
+	unsigned run_methods[NB_ELEMS(methods)] = { method };
+	unsigned nb_run_methods = 1;
+	unsigned run_primitives[NB_ELEMS(primitives)] = { primitive };
+	unsigned nb_run_primitives = 1;
+	bool primitives_set = false;
+	char const *replay_path = NULL;
+	struct range threads_range, locks_range, claims_range, job_range;
+	parse_range("100", &threads_range);
+	parse_range("100", &locks_range);
+	parse_range("3", &claims_range);
+	parse_range("1000", &job_range);
+	while ((opt = getopt(nb_args, args, "hm:L:t:l:c:s:r:D:A:K:g:E:X:d:W:k:T:S:bR:w:o:p:n:Pv")) != -1) {
+		struct range *range = NULL;
 		switch (opt) {
 			case 'h':
 				syntax();
 				return EXIT_SUCCESS;
 			case 'm':
-				method = strtoul(optarg, NULL, 0);
-				assert(method <= NB_ELEMS(methods));
+				nb_run_methods = parse_methods(optarg, run_methods);
+				if (! nb_run_methods) {
+					fprintf(stderr, "Invalid method list: %s\n", optarg);
+					return EXIT_FAILURE;
+				}
+				break;
+			case 'L':
+				nb_run_primitives = parse_primitives(optarg, run_primitives);
+				if (! nb_run_primitives) {
+					fprintf(stderr, "Invalid lock primitive list: %s\n", optarg);
+					return EXIT_FAILURE;
+				}
+				primitives_set = true;
 				break;
 			case 't':
-				nb_threads = strtoul(optarg, NULL, 0);
+				range = &threads_range;
 				break;
 			case 'l':
-				nb_locks = strtoul(optarg, NULL, 0);
+				range = &locks_range;
 				break;
 			case 'c':
-				nb_claimed = strtoul(optarg, NULL, 0);
+				range = &claims_range;
 				break;
 			case 's':
-				max_sleep_usec = strtoul(optarg, NULL, 0);
+				range = &job_range;
+				for (unsigned m = 0; m < NB_ELEMS(job_model_names); m++) {
+					size_t const len = strlen(job_model_names[m]);
+					if (0 == strncmp(optarg, job_model_names[m], len) && optarg[len] == ':') {
+						job_model = m;
+						optarg += len+1;
+						break;
+					}
+				}
+				break;
+			case 'r':
+				{
+					char *end;
+					shared_ratio = strtod(optarg, &end);
+					if (*end != '\0' || end == optarg || !(shared_ratio >= 0. && shared_ratio <= 1.)) {
+						fprintf(stderr, "Invalid shared ratio: %s\n", optarg);
+						return EXIT_FAILURE;
+					}
+				}
+				break;
+			case 'D':
+				if (0 != parse_distribution(optarg)) {
+					fprintf(stderr, "Invalid distribution: %s\n", optarg);
+					return EXIT_FAILURE;
+				}
+				break;
+			case 'A':
+				if (0 != parse_placement(optarg)) {
+					fprintf(stderr, "Invalid placement: %s\n", optarg);
+					return EXIT_FAILURE;
+				}
+				break;
+			case 'K':
+				nb_classes = strtoul(optarg, NULL, 0);
+				break;
+			case 'g':
+				hg_group_size = strtoul(optarg, NULL, 0);
+				if (! hg_group_size) {
+					fprintf(stderr, "Invalid group size: %s\n", optarg);
+					return EXIT_FAILURE;
+				}
+				break;
+			case 'E':
+				{
+					char *comma = strchr(optarg, ',');
+					if (comma) {
+						*comma = '\0';
+						trace_size = strtoul(comma+1, NULL, 0);
+						if (trace_size == 0 || (trace_size & (trace_size - 1))) {
+							fprintf(stderr, "Trace size must be a power of 2: %s\n", comma+1);
+							return EXIT_FAILURE;
+						}
+					}
+					trace_path = optarg;
+				}
+				break;
+			case 'X':
+				replay_path = optarg;
 				break;
 			case 'd':
-				duration = strtoul(optarg, NULL, 0);
+				{
+					char *end;
+					duration = strtod(optarg, &end);
+					if (end == optarg || *end != '\0' || !(duration > 0)) {
+						fprintf(stderr, "Invalid duration: %s\n", optarg);
+						return EXIT_FAILURE;
+					}
+				}
+				break;
+			case 'W':
+				warmup_msec = strtoul(optarg, NULL, 0);
+				break;
+			case 'k':
+				drain_msec = strtoul(optarg, NULL, 0);
 				break;
 			case 'T':
 				timeout_nsec = strtoull(optarg, NULL, 0);
 				break;
+			case 'S':
+				seed = strtoull(optarg, NULL, 0);
+				seed_set = true;
+				break;
+			case 'b':
+				use_lock_set = false;
+				break;
+			case 'R':
+				if (0 != parse_retry(optarg)) {
+					fprintf(stderr, "Invalid retry policy: %s\n", optarg);
+					return EXIT_FAILURE;
+				}
+				break;
+			case 'w':
+				watchdog_msec = strtoul(optarg, NULL, 0);
+				break;
+			case 'o':
+				if (0 != record_open(optarg)) return EXIT_FAILURE;
+				break;
+			case 'p':
+				{
+					char *end;
+					profile_top = strtoul(optarg, &end, 0);
+					if (end == optarg || profile_top == 0 || (*end != '\0' && *end != ',')) {
+						fprintf(stderr, "Invalid profile: %s\n", optarg);
+						return EXIT_FAILURE;
+					}
+					if (*end == ',' && 0 != profile_open(end+1)) return EXIT_FAILURE;
+				}
+				break;
+			case 'n':
+				nb_workers = strtoul(optarg, NULL, 0);
+				break;
+			case 'P':
+				perf_enabled = true;
+				break;
+			case 'v':
+				verbose = true;
+				break;
 			case '?':
 				syntax();
 				return EXIT_FAILURE;
 			case -1:
 				break;
 		}
+		if (range && (! parse_range(optarg, range) || (range != &job_range && range->first == 0))) {
+			fprintf(stderr, "Invalid value or range for -%c: %s\n", opt, optarg);
+			return EXIT_FAILURE;
+		}
 	}
 
-	printf(
-		"Running %u threads, taking %u locks (amongst %u) before sleeping %uusecs, "
-		"using method %s, repeating for %usecs...\n",
-		nb_threads, nb_claimed, nb_locks, max_sleep_usec, methods[method].name, duration);
-
-	srand(time(NULL));
-
-	thread_stride = upper_multiple_of(nb_locks, NB_BITS_PER_CELL);
-	pthread_ids = malloc(nb_threads * sizeof(*pthread_ids));
-	locks = malloc(nb_locks * sizeof(*locks));
-	recurs_count = calloc(nb_threads * nb_locks, sizeof(*recurs_count));
-	size_t const thread_wq_sz = (nb_threads << thread_stride) * sizeof(*thread_wq);
-	thread_wq = calloc(thread_wq_sz, 1);
-	if (!pthread_ids || !locks || !thread_wq) {
-		fprintf(stderr, "Cannot alloc.\n");
-		return EXIT_FAILURE;
-	}
+	shared_threshold = shared_ratio * 4294967296.;
+	if (shared_threshold && ! primitives_set) nb_run_primitives = parse_primitives("rwlock", run_primitives);
 
-	for (unsigned m = 0; m < nb_locks; m++) {
-		pthread_mutex_init(locks+m, NULL);
+	if (placement != PLACE_NONE && 0 != topology_init()) return EXIT_FAILURE;
+	if (replay_path) {	// the trace tells the threads, locks and claims
+		if (0 != replay_load(replay_path)) return EXIT_FAILURE;
+		threads_range.first = threads_range.last = nb_threads;
+		locks_range.first = locks_range.last = nb_locks;
+		claims_range.first = claims_range.last = nb_claimed;
 	}
-
-	for (unsigned t = 0; t < nb_threads; t++) {
-		pthread_create(pthread_ids+t, NULL, thread_run, (void *)(intptr_t)t);
+	if (job_model == JOB_SPIN) spin_calibrate();
+	if (nb_workers) {
+		for (unsigned p = 0; p < nb_run_primitives; p++) {
+			if (primitives[run_primitives[p]].migrates) continue;
+			fprintf(stderr, "%s locks cannot be released by another thread, so cannot be used with -n\n", primitives[run_primitives[p]].name);
+			return EXIT_FAILURE;
+		}
+		if (perf_enabled) fprintf(stderr, "Performance counters cannot follow tasks, ignoring -P\n");
+		perf_enabled = false;
 	}
+	if (perf_enabled) perf_probe();
 
-	sleep(duration);
-	printf("%"PRIu64" jobs done, %"PRIu64" errors (%.2f%%)\n", nb_trys-nb_errs, nb_errs, (100.*nb_errs)/nb_trys);
+	if (! seed_set) seed = time(NULL);
+	printf("Using seed %"PRIu64"\n", seed);
 
-	printf("Exiting... (if no deadlocks...)\n");
-	quit = 1;
-	for (unsigned t = 0; t < nb_threads; t++) {
-		pthread_join(pthread_ids[t], NULL);
-	}
+	pthread_condattr_t cond_attr;
+	pthread_condattr_init(&cond_attr);
+	pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&run_cond, &cond_attr);
+	pthread_condattr_destroy(&cond_attr);
 
-	free(pthread_ids);
-	free(locks);
-	free(recurs_count);
-	free(thread_wq);
+	if (0 != arena_alloc(range_max(&threads_range), range_max(&locks_range), range_max(&claims_range))) return EXIT_FAILURE;
+
+	bool deadlocked = false;
+
+	static struct result results[NB_ELEMS(primitives) * NB_ELEMS(methods)];
+	nb_threads = threads_range.first;
+	do {
+		nb_locks = locks_range.first;
+		do {
+			nb_claimed = claims_range.first;
+			do {
+				job_size = job_range.first;
+				do {
+					unsigned nb_res = 0;
+					for (unsigned p = 0; p < nb_run_primitives; p++) {
+						primitive = run_primitives[p];
+						for (unsigned r = 0; r < nb_run_methods; r++, nb_res++) {
+							method = run_methods[r];
+							if (0 != run(results+nb_res)) return EXIT_FAILURE;
+							record_write(results+nb_res);
+							if (results[nb_res].deadlock_after >= 0) deadlocked = true;
+						}
+					}
+					if (nb_res > 1) report_comparison(results, nb_res);
+				} while (range_next(&job_range, &job_size));
+			} while (range_next(&claims_range, &nb_claimed));
+		} while (range_next(&locks_range, &nb_locks));
+	} while (range_next(&threads_range, &nb_threads));
+
+	arena_free();
+	if (record_file && record_file != stdout) fclose(record_file);
 
-	return EXIT_SUCCESS;
+	return deadlocked ? 2 : EXIT_SUCCESS;
 }